@@ -0,0 +1,289 @@
+// Runs many independent CHIP-8 instances across a pool of threads.
+//
+// Every worker owns a deque of units of work. It pops units off the bottom
+// of its own deque and runs them for a fixed slice of frames, pushing
+// unfinished ones back onto the bottom, so it keeps working on the same
+// (cache-hot) machines until they finish. A worker whose deque is empty
+// steals from the top of someone else's, which is where the units nobody
+// has started yet are.
+//
+// With opts->lanes > 1, consecutive jobs for the same ROM are grouped into
+// units of up to that many jobs, which are scheduled as one and run in
+// lockstep by lanes_run() (see lanes.c). Otherwise every job is a unit of
+// its own, run by chip8_run() with opts->engine.
+//
+// A unit's machines are only allocated once it first runs and are freed as
+// soon as it finishes, so no more than one unit per worker is alive at a
+// time however many jobs there are.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "chip8.h"
+#include "jit.h"
+#include "lanes.h"
+#include "util.h"
+
+struct unit {
+	struct batch_job *jobs;
+	size_t            njobs;
+	size_t            pending;  // jobs that haven't finished
+	struct CHIP8     *chip8;    // njobs machines, allocated on first run
+	struct lanes     *lanes;    // if njobs > 1
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct unit   **units;   // ring buffer
+	size_t cap;
+	size_t top;              // index of the oldest unit
+	size_t len;
+};
+
+struct worker {
+	pthread_t     thread;
+	size_t        id;
+	struct deque  deque;
+	struct pool  *pool;
+};
+
+struct pool {
+	struct worker     *workers;
+	size_t             nworkers;
+	struct batch_opts *opts;
+	atomic_size_t      remaining;
+};
+
+static void
+deque_push(struct deque *d, struct unit *unit)
+{
+	pthread_mutex_lock(&d->lock);
+	ENSURE(d->len < d->cap);
+	d->units[(d->top + d->len) % d->cap] = unit;
+	d->len += 1;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static struct unit *
+deque_pop(struct deque *d)
+{
+	struct unit *unit = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->len > 0) {
+		d->len -= 1;
+		unit = d->units[(d->top + d->len) % d->cap];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return unit;
+}
+
+static struct unit *
+deque_steal(struct deque *d)
+{
+	struct unit *unit = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->len > 0) {
+		unit = d->units[d->top];
+		d->top = (d->top + 1) % d->cap;
+		d->len -= 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return unit;
+}
+
+static void
+batch_finish(struct batch_job *job, struct CHIP8 *chip8)
+{
+	if (chip8->halt == HALT_00FD)
+		job->status = BATCH_HALTED;
+	else if (chip8->halt == HALT_UNKNOWN_OP)
+		job->status = BATCH_UNKNOWN_OP;
+	else if (chip8->wait_key != -1)
+		job->status = BATCH_WAIT_KEY;
+	else
+		job->status = BATCH_LIMIT;
+
+	job->screen_hash = fnv1a(chip8->display, sizeof(chip8->display), FNV1A_INIT);
+	memcpy(job->vregs, chip8->vregs, sizeof(job->vregs));
+	job->I = chip8->I;
+	job->PC = chip8->PC;
+	job->SC = chip8->SC;
+}
+
+static void
+batch_start(struct unit *unit, struct batch_opts *opts)
+{
+	if (unit->njobs > 1) {
+		unit->lanes = ecalloc(1, sizeof(struct lanes));
+		lanes_init(unit->lanes, unit->njobs);
+		unit->chip8 = unit->lanes->m;
+	} else {
+		unit->chip8 = ecalloc_aligned(_Alignof(struct CHIP8), 1, sizeof(struct CHIP8));
+		chip8_init(unit->chip8);
+	}
+
+	for (size_t j = 0; j < unit->njobs; ++j) {
+		struct CHIP8 *chip8 = &unit->chip8[j];
+		chip8_seed(chip8, unit->jobs[j].seed);
+		chip8->engine = opts->engine;
+		chip8_load(chip8, unit->jobs[j].rom, unit->jobs[j].rom_size);
+	}
+}
+
+// Run `unit` for up to one slice. Returns true once all its jobs have
+// finished.
+static bool
+batch_slice(struct unit *unit, struct batch_opts *opts)
+{
+	if (unit->chip8 == NULL)
+		batch_start(unit, opts);
+
+	for (size_t f = 0; f < opts->slice && unit->pending > 0; ++f) {
+		size_t executed = 0;
+		if (unit->lanes != NULL) {
+			lanes_run(unit->lanes, opts->tickrate);
+			lanes_tick(unit->lanes);
+		} else {
+			executed = chip8_run(unit->chip8, opts->tickrate);
+			chip8_tick(unit->chip8);
+		}
+
+		for (size_t j = 0; j < unit->njobs; ++j) {
+			struct batch_job *job = &unit->jobs[j];
+			struct CHIP8 *chip8 = &unit->chip8[j];
+			if (job->status != BATCH_PENDING)
+				continue;
+
+			job->cycles += unit->lanes != NULL ? unit->lanes->executed[j] : executed;
+			job->frames += 1;
+
+			if (chip8->halt || chip8->wait_key != -1 || job->frames == job->max_frames) {
+				batch_finish(job, chip8);
+				unit->pending -= 1;
+			}
+		}
+	}
+
+	if (unit->pending > 0)
+		return false;
+
+	if (unit->lanes != NULL) {
+		lanes_free(unit->lanes);
+		free(unit->lanes);
+	} else {
+		jit_free(unit->chip8);
+		free(unit->chip8);
+	}
+	unit->chip8 = NULL;
+	unit->lanes = NULL;
+	return true;
+}
+
+static struct unit *
+steal(struct worker *self)
+{
+	struct pool *pool = self->pool;
+	for (size_t i = 1; i < pool->nworkers; ++i) {
+		struct worker *victim = &pool->workers[(self->id + i) % pool->nworkers];
+		struct unit *unit = deque_steal(&victim->deque);
+		if (unit != NULL) return unit;
+	}
+	return NULL;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *self = arg;
+	struct pool *pool = self->pool;
+
+	while (atomic_load(&pool->remaining) > 0) {
+		struct unit *unit = deque_pop(&self->deque);
+		if (unit == NULL) unit = steal(self);
+		if (unit == NULL) {
+			// Everything left is being run by someone else.
+			sched_yield();
+			continue;
+		}
+
+		if (batch_slice(unit, pool->opts)) {
+			atomic_fetch_sub(&pool->remaining, 1);
+		} else {
+			deque_push(&self->deque, unit);
+		}
+	}
+
+	return NULL;
+}
+
+void
+batch_run(struct batch_job *jobs, size_t njobs, struct batch_opts *opts)
+{
+	size_t width = opts->lanes > 1 ? MAX(opts->lanes, LANES_MAX) : 1;
+	struct unit *units = ecalloc(njobs > 0 ? njobs : 1, sizeof(struct unit));
+	size_t nunits = 0;
+
+	for (size_t i = 0; i < njobs; ++i) {
+		jobs[i].status = BATCH_PENDING;
+		jobs[i].cycles = 0;
+		jobs[i].frames = 0;
+
+		struct unit *last = nunits > 0 ? &units[nunits - 1] : NULL;
+		if (last != NULL && last->njobs < width
+				&& last->jobs[0].rom == jobs[i].rom
+				&& last->jobs[0].rom_size == jobs[i].rom_size
+				&& last->jobs[0].max_frames == jobs[i].max_frames) {
+			last->njobs += 1;
+			last->pending += 1;
+		} else {
+			units[nunits].jobs = &jobs[i];
+			units[nunits].njobs = 1;
+			units[nunits].pending = 1;
+			nunits += 1;
+		}
+	}
+
+	struct pool pool;
+	pool.opts = opts;
+	pool.nworkers = opts->threads;
+	if (pool.nworkers == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		pool.nworkers = ncpu > 0 ? ncpu : 1;
+	}
+	pool.nworkers = MAX(pool.nworkers, nunits > 0 ? nunits : 1);
+	pool.workers = ecalloc(pool.nworkers, sizeof(struct worker));
+	atomic_init(&pool.remaining, nunits);
+
+	// Deal the units out round-robin. A deque never holds more than its
+	// initial units plus the one its worker stole last.
+	for (size_t w = 0; w < pool.nworkers; ++w) {
+		struct worker *worker = &pool.workers[w];
+		worker->id = w;
+		worker->pool = &pool;
+		pthread_mutex_init(&worker->deque.lock, NULL);
+		worker->deque.cap = (nunits / pool.nworkers) + 2;
+		worker->deque.units = ecalloc(worker->deque.cap, sizeof(struct unit *));
+	}
+	for (size_t i = 0; i < nunits; ++i)
+		deque_push(&pool.workers[i % pool.nworkers].deque, &units[i]);
+
+	for (size_t w = 0; w < pool.nworkers; ++w) {
+		if (pthread_create(&pool.workers[w].thread, NULL, worker_main, &pool.workers[w]))
+			die("Could not create worker thread:");
+	}
+
+	for (size_t w = 0; w < pool.nworkers; ++w) {
+		pthread_join(pool.workers[w].thread, NULL);
+		pthread_mutex_destroy(&pool.workers[w].deque.lock);
+		free(pool.workers[w].deque.units);
+	}
+
+	free(pool.workers);
+	free(units);
+}
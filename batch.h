@@ -0,0 +1,45 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+enum batch_status {
+	BATCH_PENDING,
+	BATCH_HALTED,      // executed 00FD
+	BATCH_UNKNOWN_OP,  // executed an invalid instruction
+	BATCH_WAIT_KEY,    // blocked on FX0A (batch jobs have no input)
+	BATCH_LIMIT,       // ran for max_frames frames
+};
+
+struct batch_job {
+	// Filled in by the caller.
+	char       *rom;
+	size_t      rom_size;
+	unsigned    seed;
+	size_t      max_frames;
+
+	// Filled in by batch_run().
+	enum batch_status status;
+	size_t   cycles;
+	size_t   frames;
+	uint64_t screen_hash;
+	uint8_t  vregs[16];
+	uint16_t I;
+	uint16_t PC;
+	uint16_t SC;
+};
+
+struct batch_opts {
+	size_t threads;   // 0 for one per online CPU
+	size_t tickrate;  // instructions per 60 Hz frame
+	size_t slice;     // frames to run before going back to the scheduler
+	size_t lanes;     // run up to this many jobs for the same ROM in lockstep
+	enum CHIP8_engine engine;
+};
+
+void batch_run(struct batch_job *jobs, size_t njobs, struct batch_opts *opts);
+
+#endif
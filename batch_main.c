@@ -0,0 +1,153 @@
+// Runs every ROM given on the command line under a number of RNG seeds,
+// all in parallel, with no display, input or pacing. Prints one
+// tab-separated line per run with how it ended and its final state, for
+// fuzzing and regression sweeps over large ROM sets.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "batch.h"
+#include "chip8.h"
+#include "util.h"
+
+static char *
+load(char *filename, size_t *size)
+{
+	struct stat st;
+	if (stat(filename, &st) != 0)
+		die("Could not stat %s:", filename);
+	if ((size_t)st.st_size > sizeof(((struct CHIP8 *)0)->memory) - ROM_START)
+		die("%s is too large (%zu bytes)", filename, (size_t)st.st_size);
+
+	char *src = ecalloc(st.st_size + 1, sizeof(char));
+	FILE *src_f = fopen(filename, "rb");
+	if (src_f == NULL)
+		die("Could not open %s:", filename);
+	fread(src, sizeof(char), st.st_size, src_f);
+	fclose(src_f);
+
+	*size = st.st_size;
+	return src;
+}
+
+static double
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+static void
+usage(char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-j threads] [-s seeds] [-f frames] [-t tickrate]\n"
+		"       %*s [-l slice] [-w lanes] [-e switch|threaded|jit] rom...\n",
+		argv0, (int)strlen(argv0), "");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *engines[] = {
+		[ENGINE_SWITCH]   = "switch",
+		[ENGINE_THREADED] = "threaded",
+		[ENGINE_JIT]      = "jit",
+	};
+	const char *statuses[] = {
+		[BATCH_PENDING]    = "pending",
+		[BATCH_HALTED]     = "halted",
+		[BATCH_UNKNOWN_OP] = "unknown-op",
+		[BATCH_WAIT_KEY]   = "wait-key",
+		[BATCH_LIMIT]      = "limit",
+	};
+
+	struct batch_opts opts = {
+		.threads  = 0,
+		.tickrate = 1500,
+		.slice    = 60,
+		.lanes    = 1,
+		.engine   = CHIP8_DEFAULT_ENGINE,
+	};
+	size_t seeds = 1;
+	size_t max_frames = 600;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "j:s:f:t:l:w:e:")) != -1) {
+		switch (opt) {
+		break; case 'j':
+			opts.threads = strtoull(optarg, NULL, 0);
+		break; case 's':
+			seeds = strtoull(optarg, NULL, 0);
+		break; case 'f':
+			max_frames = strtoull(optarg, NULL, 0);
+		break; case 't':
+			opts.tickrate = strtoull(optarg, NULL, 0);
+		break; case 'l':
+			opts.slice = strtoull(optarg, NULL, 0);
+		break; case 'w':
+			opts.lanes = strtoull(optarg, NULL, 0);
+		break; case 'e': {
+			ssize_t engine = -1;
+			for (size_t i = 0; i < SIZEOF(engines); ++i)
+				if (!strcmp(optarg, engines[i])) engine = i;
+			if (engine == -1) usage(argv[0]);
+			opts.engine = engine;
+		} break; default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc || seeds == 0 || max_frames == 0
+			|| opts.tickrate == 0 || opts.slice == 0)
+		usage(argv[0]);
+
+	size_t nroms = argc - optind;
+	size_t njobs = nroms * seeds;
+	struct batch_job *jobs = ecalloc(njobs, sizeof(struct batch_job));
+
+	for (size_t r = 0; r < nroms; ++r) {
+		size_t size;
+		char *rom = load(argv[optind + r], &size);
+		for (size_t s = 0; s < seeds; ++s) {
+			struct batch_job *job = &jobs[r * seeds + s];
+			job->rom = rom;
+			job->rom_size = size;
+			job->seed = s + 1;
+			job->max_frames = max_frames;
+		}
+	}
+
+	double start = now();
+	batch_run(jobs, njobs, &opts);
+	double elapsed = now() - start;
+
+	size_t cycles = 0;
+	printf("#rom\tseed\tstatus\tframes\tinstructions\tdisplay\tI\tPC\tSC\tregisters\n");
+	for (size_t i = 0; i < njobs; ++i) {
+		struct batch_job *job = &jobs[i];
+		printf("%s\t%u\t%s\t%zu\t%zu\t%016llx\t%04X\t%04X\t%04X\t",
+			argv[optind + i / seeds], job->seed, statuses[job->status],
+			job->frames, job->cycles, (unsigned long long)job->screen_hash,
+			job->I, job->PC, job->SC);
+		for (size_t r = 0; r < 16; ++r)
+			printf("%02X%c", job->vregs[r], r == 15 ? '\n' : ' ');
+		cycles += job->cycles;
+	}
+
+	fprintf(stderr, "%zu runs, %zu instructions in %.6f s (%.2f M instructions/s)\n",
+		njobs, cycles, elapsed, elapsed > 0 ? cycles / elapsed / 1e6 : 0);
+
+	for (size_t r = 0; r < nroms; ++r)
+		free(jobs[r * seeds].rom);
+	free(jobs);
+
+	return 0;
+}
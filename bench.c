@@ -0,0 +1,270 @@
+// Benchmarks of the core, run by `make bench` to catch a build that got
+// slower before it ships.
+//
+// The micro benchmarks time one thing over and over: chip8_next(), one
+// instruction of each type through chip8_step() (the sprite sizes, scrolls
+// and clears in both lores and hires), and the expansion of the display
+// into pixels that the SDL frontend does every frame. The macro benchmarks
+// run small ROMs built in here, each leaning on one thing real games do a
+// lot of, on every engine. Each reports ns per operation and millions of
+// operations a second, an operation being an instruction in the step and
+// ROM benchmarks and a whole frame in the expansion ones.
+//
+// Every benchmark is first run with twice as many repetitions until they
+// take BENCH_MIN_NS, then timed BENCH_TRIALS times over; the fastest
+// trial is the one least disturbed by whatever else the host was doing,
+// and so the most repeatable from one run to the next.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "util.h"
+
+#define BENCH_MIN_NS 20000000ULL // 20 ms
+#define BENCH_TRIALS 5
+#define BENCH_FRAME  1000        // instructions between timer ticks in the macro benchmarks
+#define BENCH_SPRITE 0x800       // where I points to, away from the code
+
+static struct CHIP8 chip8;
+static uint32_t pixels[S_D_WIDTH * S_D_HEIGHT];
+static volatile uint64_t sink; // keeps results the compiler could otherwise throw away
+
+static uint64_t
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// The fastest of BENCH_TRIALS runs of `n` repetitions of `fn`, in ns per
+// repetition.
+static double
+bench(void (*fn)(size_t n))
+{
+	size_t n = 1;
+	uint64_t elapsed;
+	for (;; n *= 2) {
+		uint64_t start = now();
+		fn(n);
+		elapsed = now() - start;
+		if (elapsed >= BENCH_MIN_NS) break;
+	}
+
+	double best = (double)elapsed / n;
+	for (size_t trial = 0; trial < BENCH_TRIALS; ++trial) {
+		uint64_t start = now();
+		fn(n);
+		double ns = (double)(now() - start) / n;
+		if (ns < best) best = ns;
+	}
+	return best;
+}
+
+static void
+report(const char *name, double ns)
+{
+	printf("%-24s %10.2f ns/op %10.2f M op/s\n", name, ns, 1e3 / ns);
+}
+
+// A fresh machine with V0 = 20, V1 = 5 and I pointing at a sprite.
+static void
+setup(bool hires)
+{
+	jit_free(&chip8);
+	chip8_init(&chip8);
+	chip8_seed(&chip8, 0);
+	chip8.hires = hires;
+	chip8.vregs[0] = 20;
+	chip8.vregs[1] = 5;
+	chip8.I = BENCH_SPRITE;
+	memset(&chip8.memory[BENCH_SPRITE], 0xAA, 64);
+	chip8_invalidate(&chip8, BENCH_SPRITE, 64);
+}
+
+static void
+run_next(size_t n)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0; i < n; ++i)
+		sum += chip8_next(&chip8, (2 * i) & CHIP8_MEM_MASK).type;
+	sink = sum;
+}
+
+// The instruction at ROM_START, over and over.
+static void
+run_step(size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		chip8.PC = ROM_START;
+		chip8_step(&chip8);
+	}
+}
+
+static void
+run_expand(size_t n)
+{
+	const uint32_t colors[] = { 0x001000ff, 0xeeeeeeff, 0x7fffd4ff, 0xffebcdff };
+	size_t first, last;
+	for (size_t i = 0; i < n; ++i)
+		chip8_display_expand(chip8.display, UINT64_MAX, chip8.hires, colors, pixels, &first, &last);
+	sink = pixels[0];
+}
+
+// `n` instructions of the ROM loaded, a frame at a time.
+static void
+run_rom(size_t n)
+{
+	while (n > 0) {
+		size_t ran = chip8_run(&chip8, MAX(n, BENCH_FRAME));
+		if (ran == 0)
+			die("The benchmark ROM stopped at %04X", chip8.PC);
+		chip8_tick(&chip8);
+		n -= ran;
+	}
+}
+
+static const struct {
+	const char *name;
+	uint16_t    op;
+	uint16_t    next; // what follows it, for F000
+	bool        hires;
+} steps[] = {
+	{ "00C4 lores",      0x00C4, 0, false }, { "00C4 hires",      0x00C4, 0, true },
+	{ "00D4 lores",      0x00D4, 0, false }, { "00D4 hires",      0x00D4, 0, true },
+	{ "00FB lores",      0x00FB, 0, false }, { "00FB hires",      0x00FB, 0, true },
+	{ "00FC lores",      0x00FC, 0, false }, { "00FC hires",      0x00FC, 0, true },
+	{ "00E0 lores",      0x00E0, 0, false }, { "00E0 hires",      0x00E0, 0, true },
+	{ "00EE",            0x00EE, 0, false },
+	{ "1NNN",            0x1200, 0, false },
+	{ "2NNN",            0x2200, 0, false },
+	{ "3XNN",            0x3014, 0, false },
+	{ "4XNN",            0x4014, 0, false },
+	{ "5XY0",            0x5010, 0, false },
+	{ "5XY2",            0x5012, 0, false },
+	{ "5XY3",            0x5013, 0, false },
+	{ "6XNN",            0x6A12, 0, false },
+	{ "7XNN",            0x7A01, 0, false },
+	{ "8XY0",            0x8010, 0, false },
+	{ "8XY1",            0x8011, 0, false },
+	{ "8XY4",            0x8014, 0, false },
+	{ "8XY5",            0x8015, 0, false },
+	{ "8X06",            0x8006, 0, false },
+	{ "8XY7",            0x8017, 0, false },
+	{ "8X0E",            0x800E, 0, false },
+	{ "9XY0",            0x9010, 0, false },
+	{ "ANNN",            0xA800, 0, false },
+	{ "BNNN",            0xB200, 0, false },
+	{ "CXNN",            0xC2FF, 0, false },
+	{ "DXYN 8x1 lores",  0xD011, 0, false }, { "DXYN 8x1 hires",  0xD011, 0, true },
+	{ "DXYN 8x15 lores", 0xD01F, 0, false }, { "DXYN 8x15 hires", 0xD01F, 0, true },
+	{ "DXYN 16x16 lores",0xD010, 0, false }, { "DXYN 16x16 hires",0xD010, 0, true },
+	{ "EX9E",            0xE09E, 0, false },
+	{ "EXA1",            0xE0A1, 0, false },
+	{ "F000",            0xF000, BENCH_SPRITE, false },
+	{ "FX01",            0xF101, 0, false },
+	{ "F002",            0xF002, 0, false },
+	{ "FX07",            0xF007, 0, false },
+	{ "FX15",            0xF015, 0, false },
+	{ "FX18",            0xF018, 0, false },
+	{ "FX1E",            0xF01E, 0, false },
+	{ "FX29",            0xF029, 0, false },
+	{ "FX30",            0xF030, 0, false },
+	{ "FX33",            0xF033, 0, false },
+	{ "FX3A",            0xF03A, 0, false },
+	{ "FF55",            0xFF55, 0, false },
+	{ "FF65",            0xFF65, 0, false },
+	{ "FF75",            0xFF75, 0, false },
+	{ "FF85",            0xFF85, 0, false },
+};
+
+// Draws the digits all over the screen.
+static const uint8_t sprite_rom[] = {
+	0x60, 0x00, // V0 = 0
+	0x61, 0x00, // V1 = 0
+	0x62, 0x00, // V2 = 0
+	0xF2, 0x29, // loop: I = digit V2
+	0xD0, 0x15, // draw it at V0, V1
+	0x70, 0x05, // V0 += 5
+	0x71, 0x03, // V1 += 3
+	0x72, 0x01, // V2 += 1
+	0x12, 0x06, // goto loop
+};
+
+// Counts V3 up in decimal, like a score.
+static const uint8_t bcd_rom[] = {
+	0xA3, 0x00, // I = 0x300
+	0xF3, 0x33, // loop: BCD of V3 at I
+	0xF2, 0x65, // V0..V2 = the digits
+	0x73, 0x01, // V3 += 1
+	0x12, 0x02, // goto loop
+};
+
+// Calls a subroutine that calls another.
+static const uint8_t call_rom[] = {
+	0x22, 0x06, // loop: call a
+	0x12, 0x00, // goto loop
+	0x00, 0x00,
+	0x22, 0x0A, // a: call b
+	0x00, 0xEE, // return
+	0x70, 0x01, // b: V0 += 1
+	0x00, 0xEE, // return
+};
+
+static const struct {
+	const char    *name;
+	const uint8_t *rom;
+	size_t         size;
+} roms[] = {
+	{ "sprites", sprite_rom, sizeof(sprite_rom) },
+	{ "bcd",     bcd_rom,    sizeof(bcd_rom) },
+	{ "calls",   call_rom,   sizeof(call_rom) },
+};
+
+int
+main(void)
+{
+	const char *engines[] = {
+		[ENGINE_SWITCH]   = "switch",
+		[ENGINE_THREADED] = "threaded",
+		[ENGINE_JIT]      = "jit",
+	};
+
+	// All of memory random, so that chip8_next() sees every type.
+	setup(false);
+	for (size_t i = 0; i < CHIP8_MEM_SIZE; ++i)
+		chip8.memory[i] = chip8_random(&chip8);
+	chip8_invalidate(&chip8, 0, CHIP8_MEM_SIZE);
+	report("chip8_next", bench(run_next));
+
+	for (size_t i = 0; i < SIZEOF(steps); ++i) {
+		setup(steps[i].hires);
+		uint8_t code[] = { steps[i].op >> 8, steps[i].op, steps[i].next >> 8, steps[i].next };
+		memcpy(&chip8.memory[ROM_START], code, sizeof(code));
+		chip8_invalidate(&chip8, ROM_START, sizeof(code));
+		report(format("step %s", steps[i].name), bench(run_step));
+	}
+
+	for (size_t hires = 0; hires < 2; ++hires) {
+		setup(hires);
+		for (size_t y = 0; y < S_D_HEIGHT; ++y)
+			for (size_t w = 0; w < S_D_WIDTH / 64; ++w)
+				chip8.display[y % 2][y][w] = 0x0123456789ABCDEFULL << y;
+		report(hires ? "expand hires" : "expand lores", bench(run_expand));
+	}
+
+	for (size_t i = 0; i < SIZEOF(roms); ++i)
+		for (size_t e = 0; e < SIZEOF(engines); ++e) {
+			setup(false);
+			chip8.engine = e;
+			chip8_load(&chip8, (char *)roms[i].rom, roms[i].size);
+			report(format("%s %s", roms[i].name, engines[e]), bench(run_rom));
+		}
+
+	jit_free(&chip8);
+	return 0;
+}
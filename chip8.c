@@ -1,20 +1,23 @@
+#include <errno.h>
 #include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <time.h>
 
 #include "chip8.h"
+#include "jit.h"
 #include "util.h"
 
 void
-chip8_init(struct CHIP8 *chip8, keydown_fn_t keydown)
+chip8_init(struct CHIP8 *chip8)
 {
-	srand(time(NULL));
-
 	memset((void *)chip8->memory, 0x0, sizeof(chip8->memory));
-	memset((void *)chip8->display, false, sizeof(chip8->display));
+	memset((void *)chip8->display, 0x0, sizeof(chip8->display));
 	chip8->plane = 1;
 	chip8->PC = ROM_START;
 	chip8->I = 0;
@@ -23,201 +26,879 @@ chip8_init(struct CHIP8 *chip8, keydown_fn_t keydown)
 	chip8->delay_tmr = 0;
 	chip8->sound_tmr = 0;
 	memset((void *)chip8->vregs, 0, sizeof(chip8->vregs));
-	chip8->redraw = false;
-	chip8->halt = false;
+	memset((void *)chip8->fregs, 0, sizeof(chip8->fregs));
+	// Until a ROM loads a pattern of its own, a 1 kHz square wave.
+	memset((void *)chip8->pattern, 0xCC, sizeof(chip8->pattern));
+	chip8->pitch = 64;
+	chip8->dirty_rows = UINT64_MAX;
+	chip8->halt = HALT_NONE;
+	chip8_seed(chip8, time(NULL));
 	chip8->hires = false;
 	chip8->wait_key = -1;
-	chip8->keydown_fn = keydown;
+	chip8->keypad = 0;
+	chip8->engine = CHIP8_DEFAULT_ENGINE;
+	chip8->jit = NULL;
+	chip8->snap = NULL;
+#ifdef CHIP8_PROFILER
+	chip8->profile = NULL;
+#endif
+	memset((void *)chip8->dirty, 0, sizeof(chip8->dirty));
 
 	// set fonts
 	memcpy((void *)&chip8->memory[FONT_START], (void *)&fonts, sizeof(fonts));
 	memcpy((void *)&chip8->memory[S_FONT_START], (void *)&s_fonts, sizeof(s_fonts));
 }
 
+// Start CXNN's random numbers over from `seed`. Machines seeded the same
+// draw the same numbers, whatever else is running alongside them.
+// chip8_init() seeds from the clock, so anything that has to come out the
+// same every run (ch8-headless, ch8-batch, movies) calls this after it.
+void
+chip8_seed(struct CHIP8 *chip8, uint64_t seed)
+{
+	chip8->rng = 0;
+	chip8_random(chip8);
+	chip8->rng += seed;
+	chip8_random(chip8);
+}
+
+// Press or let go of a key. Letting go of one answers an FX0A, as on the
+// COSMAC VIP, whose FX0A waited for a key to be pressed and released.
+void
+chip8_key(struct CHIP8 *chip8, size_t key, bool down)
+{
+	ENSURE(key < 16);
+
+	uint16_t keys = chip8->keypad & ~(1 << key);
+	chip8_keypad(chip8, keys | (down << key));
+}
+
+// Set every key at once. If more than one is let go of while an FX0A is
+// waiting, the lowest answers it.
+void
+chip8_keypad(struct CHIP8 *chip8, uint16_t keys)
+{
+	uint16_t released = chip8->keypad & ~keys;
+	chip8->keypad = keys;
+
+	if (chip8->wait_key == -1 || released == 0)
+		return;
+
+	size_t key = 0;
+	while (!((released >> key) & 1))
+		++key;
+
+	chip8->vregs[chip8->wait_key] = key;
+	chip8->wait_key = -1;
+}
+
+// Load a ROM at ROM_START. Frontends check the size of what they read
+// first; one that doesn't fit is a bug, not bad input.
 void
 chip8_load(struct CHIP8 *chip8, char *data, size_t sz)
 {
+	if (sz > CHIP8_MEM_SIZE - ROM_START)
+		die("A %zu byte ROM doesn't fit in %d bytes of memory", sz, CHIP8_MEM_SIZE);
+
 	memcpy(&chip8->memory[ROM_START], data, sz);
+	chip8_invalidate(chip8, ROM_START, sz);
 }
 
-struct CHIP8_inst
-chip8_next(struct CHIP8 *chip8, size_t where)
+static enum CHIP8_inst_type
+chip8_decode(uint16_t op)
 {
-	struct CHIP8_inst inst;
+	enum CHIP8_inst_type type;
 
-	uint8_t op1 = chip8->memory[where];
-	uint8_t op2 = chip8->memory[where + 1];
-	uint8_t op3 = (where + 2) < SIZEOF(chip8->memory) ? chip8->memory[where + 2] : 0;
-	uint8_t op4 = (where + 3) < SIZEOF(chip8->memory) ? chip8->memory[where + 3] : 0;
-
-	inst.op     = (op1 << 8) | op2;
-	inst.op_len = inst.op == 0xF000 ? 4 : 2;
-	inst.P      = (inst.op >> 12);
-	inst.X      = (inst.op >>  8) & 0xF;
-	inst.Y      = (inst.op >>  4) & 0xF;
-	inst.N      = (inst.op >>  0) & 0xF;
-	inst.NN     = (inst.op >>  0) & 0xFF;
-	inst.NNN    = (inst.op >>  0) & 0xFFF;
-	inst.NNNN   = (op3 << 8) | op4;
+	uint8_t P  = (op >> 12);
+	uint8_t Y  = (op >>  4) & 0xF;
+	uint8_t N  = (op >>  0) & 0xF;
+	uint8_t NN = (op >>  0) & 0xFF;
 
-	switch (inst.P) {
+	switch (P) {
 	break; case 0x0:
-		switch (inst.Y) {
+		switch (Y) {
 		break; case 0xC: // 00CN: (SCHIP) Scroll down by N pixels.
-			inst.type = I_00CN;
+			type = I_00CN;
 		break; case 0xD: // 00DN: (XO) Scroll up by N pixels.
-			inst.type = I_00DN;
+			type = I_00DN;
 		break; default:
-			switch (inst.op) {
+			switch (op) {
 			break; case 0x00E0: // 00E0: CLS - reset display
-				inst.type = I_00E0;
+				type = I_00E0;
 			break; case 0x00EE: // 00EE: RET - pop stack frame and return to that address
-				inst.type = I_00EE;
+				type = I_00EE;
 			break; case 0x00FB: // 00FB: Scroll right by 4 pixels.
-				inst.type = I_00FB;
+				type = I_00FB;
 			break; case 0x00FC: // 00FC: Scroll left by 4 pixels.
-				inst.type = I_00FC;
+				type = I_00FC;
 			break; case 0x00FD: // 00FD: Halt.
-				inst.type = I_00FD;
+				type = I_00FD;
 			break; case 0x00FE: // 00FE: Disable hi-res mode.
-				inst.type = I_00FE;
+				type = I_00FE;
 			break; case 0x00FF: // 00FF: Enable hi-res mode.
-				inst.type = I_00FF;
+				type = I_00FF;
 			break; default:
-				inst.type = I_UNKNOWN;
+				type = I_UNKNOWN;
 			break;
 			};
 		}
 	break; case 0x1: // 1NNN: JMP - Jump to NNN
-		inst.type = I_1NNN;
+		type = I_1NNN;
 	break; case 0x2: // 2NNN: CAL - Push current PC, jump to NNN
-		inst.type = I_2NNN;
+		type = I_2NNN;
 	break; case 0x3: // 3XNN: Skip next if X == NN
-		inst.type = I_3XNN;
+		type = I_3XNN;
 	break; case 0x4: // 4XNN: Skip next if X != NN
-		inst.type = I_4XNN;
+		type = I_4XNN;
 	break; case 0x5:
-		switch (inst.N) {
+		switch (N) {
 		break; case 0: // 5XY0: Skip next if X == Y
-			inst.type = I_5XY0;
+			type = I_5XY0;
 		break; case 2: // 5XY2: (XO) Save registers VX..=VY to memory starting at I.
-			inst.type = I_5XY2;
+			type = I_5XY2;
 		break; case 3: // 5XY3: Load registers VX..=VY from memory starting at I.
-			inst.type = I_5XY3;
+			type = I_5XY3;
 		break; default:
-			inst.type = I_UNKNOWN;
+			type = I_UNKNOWN;
 		break;
 		}
 	break; case 0x6: // 6XNN: Set VX = NN
-		inst.type = I_6XNN;
+		type = I_6XNN;
 	break; case 0x7: // 7XNN: Add NN to VX
-		inst.type = I_7XNN;
+		type = I_7XNN;
 	break; case 0x8:
-		switch (inst.N) {
+		switch (N) {
 		break; case 0x0: // 8XY0: VX = VY
-			inst.type = I_8XY0;
+			type = I_8XY0;
 		break; case 0x1: // 8XY1: VX |= VY
-			inst.type = I_8XY1;
+			type = I_8XY1;
 		break; case 0x2: // 8XY2: VX &= VY
-			inst.type = I_8XY2;
+			type = I_8XY2;
 		break; case 0x3: // 8XY3: VX ^= VY
-			inst.type = I_8XY3;
+			type = I_8XY3;
 		break; case 0x4: // 8XY4: VX += VY (VF == overflow?)
-			inst.type = I_8XY4;
+			type = I_8XY4;
 		break; case 0x5: // 8XY5: VX -= VY
-			inst.type = I_8XY5;
+			type = I_8XY5;
 		break; case 0x6: // 8X06: VX >>= 1, VF = LSB
-			inst.type = I_8X06;
+			type = I_8X06;
 		break; case 0x7: // 8XY7: VX = VY - VX
-			inst.type = I_8XY7;
+			type = I_8XY7;
 		break; case 0xE: // 8X0E: VX <<= 1, VF = MSB
-			inst.type = I_8X0E;
+			type = I_8X0E;
 		break; default:
-			inst.type = I_UNKNOWN;
+			type = I_UNKNOWN;
 		break;
 		}
 	break; case 0x9: // 9XY0: Skip next if X != Y
-		inst.type = I_9XY0;
+		type = I_9XY0;
 	break; case 0xA: // ANNN: Set I to NNN
-		inst.type = I_ANNN;
+		type = I_ANNN;
 	break; case 0xB: // BNNN: Jump to V0 + NNN
-		inst.type = I_BNNN;
+		type = I_BNNN;
 	break; case 0xC: // CXNN: VX = rand() & NN
-		inst.type = I_CXNN;
+		type = I_CXNN;
 	break; case 0xD: // DXYN: Draw a sprite with a height of N at coord VX,VY
-		inst.type = I_DXYN;
+		type = I_DXYN;
 	break; case 0xE:
-		switch (inst.NN) {
+		switch (NN) {
 		break; case 0x9E: // EX9E: Skip next if key VX is pressed
-			inst.type = I_EX9E;
+			type = I_EX9E;
 		break; case 0xA1: // EXA1: Skip next if key VX is not pressed
-			inst.type = I_EXA1;
+			type = I_EXA1;
 		break; default:
-			inst.type = I_UNKNOWN;
+			type = I_UNKNOWN;
 		break;
 		}
 	break; case 0xF:
-		switch (inst.NN) {
+		switch (NN) {
 		break; case 0x00: // F000: (XO) Load I with the next word.
-			inst.type = I_F000;
+			type = I_F000;
 		break; case 0x01: // FX01: (XO) Select X planes
-			inst.type = I_FX01;
+			type = I_FX01;
 		break; case 0x02: // F002: Store 16 bytes starting at I in the audio pattern buffer.
-			inst.type = I_F002;
+			type = I_F002;
 		break; case 0x07: // FX07: Set VX value of delay timer
-			inst.type = I_FX07;
+			type = I_FX07;
 		break; case 0x15: // FX15: Set delay timer to VX
-			inst.type = I_FX15;
+			type = I_FX15;
 		break; case 0x18: // FX18: Set sound timer to VX
-			inst.type = I_FX18;
+			type = I_FX18;
 		break; case 0x29: // FX29: Set I to FONT_START + VX
-			inst.type = I_FX29;
+			type = I_FX29;
 		break; case 0x30: // FX30: Set I to S_FONT_START + VX
-			inst.type = I_FX30;
+			type = I_FX30;
 		break; case 0x1E: // FX1E: Add VX to I
-			inst.type = I_FX1E;
+			type = I_FX1E;
 		break; case 0x0A: // FX0A: Wait until a key is pressed, then store in VX
-			inst.type = I_FX0A;
+			type = I_FX0A;
 		break; case 0x33: // FX33: Convert VX to 3-char string and place at I[0..2]
-			inst.type = I_FX33;
+			type = I_FX33;
 		break; case 0x55: // FX55: Load registers V0..=VX into memory[I..]
-			inst.type = I_FX55;
+			type = I_FX55;
 		break; case 0x65: // FX65: Load memory[I..] into registers V0..=VX
-			inst.type = I_FX65;
+			type = I_FX65;
 		break; case 0x75: // FX75: Save registers V0..=VX into flag registers
-			inst.type = I_FX75;
+			type = I_FX75;
 		break; case 0x85: // FX85: Load registers V0..=VX from flag registers
-			inst.type = I_FX85;
+			type = I_FX85;
+		break; case 0x3A: // FX3A: (XO) Set the audio pitch to VX
+			type = I_FX3A;
 		break; default:
-			inst.type = I_UNKNOWN;
+			type = I_UNKNOWN;
 		break;
 		}
 	break; default:
-		inst.type = I_UNKNOWN;
+		type = I_UNKNOWN;
 	break;
 	};
 
+	return type;
+}
+
+// Decoded instruction types by opcode, plus one, or 0 for opcodes not
+// seen yet. A type depends on nothing but the opcode, so one table serves
+// every machine in the process, and no store to memory can make it stale.
+// Machines on other threads may race to fill in an entry, but only ever
+// with the same value.
+static _Atomic uint8_t decoded[UINT16_MAX + 1];
+
+// Look up the type of `op`, decoding it only the first time it's seen.
+static inline enum CHIP8_inst_type
+chip8_type(uint16_t op)
+{
+	uint8_t type = atomic_load_explicit(&decoded[op], memory_order_relaxed);
+	if (type == 0) {
+		type = chip8_decode(op) + 1;
+		atomic_store_explicit(&decoded[op], type, memory_order_relaxed);
+	}
+	return type - 1;
+}
+
+static inline size_t
+chip8_op_len(struct CHIP8 *chip8, size_t where)
+{
+	return chip8->memory[where & CHIP8_MEM_MASK] == 0xF0
+	    && chip8->memory[(where + 1) & CHIP8_MEM_MASK] == 0x00 ? 4 : 2;
+}
+
+// Must be called after anything writes to memory[addr..addr+len], so
+// that stale translations, if the JIT is in use, aren't executed. The
+// range may wrap around the end of memory. The pages written are also
+// marked dirty, for snapshot_take().
+void
+chip8_invalidate(struct CHIP8 *chip8, size_t addr, size_t len)
+{
+	addr &= CHIP8_MEM_MASK;
+	if (addr + len > CHIP8_MEM_SIZE) {
+		size_t head = CHIP8_MEM_SIZE - addr;
+		chip8_invalidate(chip8, addr, head);
+		chip8_invalidate(chip8, 0, len - head);
+		return;
+	}
+
+	size_t end = addr + len;
+	for (size_t pg = addr >> CHIP8_PAGE_SHIFT; len > 0 && pg <= (end - 1) >> CHIP8_PAGE_SHIFT; ++pg)
+		chip8->dirty[pg / 64] |= (uint64_t)1 << (pg % 64);
+
+	if (chip8->jit != NULL)
+		jit_invalidate(chip8, addr, len);
+}
+
+// Called at 60 Hz by the frontend.
+void
+chip8_tick(struct CHIP8 *chip8)
+{
+	if (chip8->delay_tmr > 0) --chip8->delay_tmr;
+	if (chip8->sound_tmr > 0) --chip8->sound_tmr;
+}
+
+void
+chip8_unpack(struct CHIP8 *chip8, uint8_t *out)
+{
+	for (size_t y = 0; y < D_HEIGHT; ++y)
+		for (size_t x = 0; x < D_WIDTH; ++x)
+			*out++ = chip8_pixel(chip8, x, y);
+}
+
+struct CHIP8_inst
+chip8_next(struct CHIP8 *chip8, size_t where)
+{
+	struct CHIP8_inst inst;
+
+	uint8_t op1 = chip8->memory[(where + 0) & CHIP8_MEM_MASK];
+	uint8_t op2 = chip8->memory[(where + 1) & CHIP8_MEM_MASK];
+	uint8_t op3 = chip8->memory[(where + 2) & CHIP8_MEM_MASK];
+	uint8_t op4 = chip8->memory[(where + 3) & CHIP8_MEM_MASK];
+
+	inst.op     = (op1 << 8) | op2;
+	inst.type   = chip8_type(inst.op);
+	inst.op_len = inst.op == 0xF000 ? 4 : 2;
+	inst.P      = (inst.op >> 12);
+	inst.X      = (inst.op >>  8) & 0xF;
+	inst.Y      = (inst.op >>  4) & 0xF;
+	inst.N      = (inst.op >>  0) & 0xF;
+	inst.NN     = (inst.op >>  0) & 0xFF;
+	inst.NNN    = (inst.op >>  0) & 0xFFF;
+	inst.NNNN   = (op3 << 8) | op4;
+
 	return inst;
 }
 
-// Stolen from:
-// https://github.com/JohnEarnest/c-octo, src/octo_emulator.h, octo_emulator_move_pix()
-//
+// The scroll kernels work on whole rows of the packed display: vertical
+// scrolls are a memmove of each selected plane's rows, horizontal ones a
+// 4-bit shift across each row's words. In lores mode only the first 32
+// rows and the first word of each row are in use; the rest stay zero.
+
+static void
+chip8_scroll_down(struct CHIP8 *chip8, size_t n)
+{
+	size_t rowsz = sizeof(chip8->display[0][0]);
+	for (size_t plane = 1; plane <= 2; ++plane) {
+		if ((chip8->plane & plane) == 0) continue;
+		chip8->dirty_rows = UINT64_MAX;
+		uint64_t (*rows)[S_D_WIDTH / 64] = chip8->display[plane - 1];
+		memmove(&rows[n], &rows[0], (D_HEIGHT - n) * rowsz);
+		memset(&rows[0], 0x0, n * rowsz);
+	}
+}
+
+static void
+chip8_scroll_up(struct CHIP8 *chip8, size_t n)
+{
+	size_t rowsz = sizeof(chip8->display[0][0]);
+	for (size_t plane = 1; plane <= 2; ++plane) {
+		if ((chip8->plane & plane) == 0) continue;
+		chip8->dirty_rows = UINT64_MAX;
+		uint64_t (*rows)[S_D_WIDTH / 64] = chip8->display[plane - 1];
+		memmove(&rows[0], &rows[n], (D_HEIGHT - n) * rowsz);
+		memset(&rows[D_HEIGHT - n], 0x0, n * rowsz);
+	}
+}
+
+static void
+chip8_scroll_right(struct CHIP8 *chip8)
+{
+	for (size_t plane = 1; plane <= 2; ++plane) {
+		if ((chip8->plane & plane) == 0) continue;
+		chip8->dirty_rows = UINT64_MAX;
+		for (size_t y = 0; y < D_HEIGHT; ++y) {
+			uint64_t *row = chip8->display[plane - 1][y];
+			row[1] = chip8->hires ? (row[1] >> 4) | (row[0] << 60) : 0;
+			row[0] >>= 4;
+		}
+	}
+}
+
 static void
-chip8_mvpx(struct CHIP8 *chip8, ssize_t dx, ssize_t dy, ssize_t sx, ssize_t sy)
+chip8_scroll_left(struct CHIP8 *chip8)
 {
 	for (size_t plane = 1; plane <= 2; ++plane) {
-		if (chip8->plane & plane) {
-			uint8_t *d = &chip8->display[(dy * D_WIDTH) + dx];
-			uint8_t *s = &chip8->display[(sy * D_WIDTH) + sx];
-			uint8_t color = (sx < 0 || sy < 0 || sx >= D_WIDTH || sy >= D_HEIGHT)
-				? 0 : plane & *s;
-			*d &= ~plane; // Remove old pixel
-			*d |= color;  // Set new pixel
+		if ((chip8->plane & plane) == 0) continue;
+		chip8->dirty_rows = UINT64_MAX;
+		for (size_t y = 0; y < D_HEIGHT; ++y) {
+			uint64_t *row = chip8->display[plane - 1][y];
+			row[0] = (row[0] << 4) | (row[1] >> 60);
+			row[1] <<= 4;
 		}
 	}
 }
 
+static void
+chip8_clear(struct CHIP8 *chip8)
+{
+	for (size_t plane = 1; plane <= 2; ++plane) {
+		if ((chip8->plane & plane) == 0) continue;
+		chip8->dirty_rows = UINT64_MAX;
+		memset(chip8->display[plane - 1], 0x0, sizeof(chip8->display[0]));
+	}
+}
+
+static void
+chip8_set_hires(struct CHIP8 *chip8, bool hires)
+{
+	chip8->hires = hires;
+	chip8->dirty_rows = UINT64_MAX;
+	memset(chip8->display, 0x0, sizeof(chip8->display));
+}
+
+// Place a `width`-pixel sprite row (MSB leftmost) at column x of a display
+// row `d_width` pixels wide, wrapping around the right edge.
+static inline void
+chip8_sprite_row(uint64_t sprite, size_t width, size_t x, size_t d_width, uint64_t out[2])
+{
+	uint64_t hi = sprite << (64 - width);
+	uint64_t lo = 0;
+
+	if (d_width == 64) {
+		out[0] = x == 0 ? hi : (hi >> x) | (hi << (64 - x));
+		out[1] = 0;
+		return;
+	}
+
+	if (x >= 64) {
+		lo = hi;
+		hi = 0;
+		x -= 64;
+	}
+
+	if (x != 0) {
+		uint64_t new_hi = (hi >> x) | (lo << (64 - x));
+		lo = (lo >> x) | (hi << (64 - x));
+		hi = new_hi;
+	}
+
+	out[0] = hi;
+	out[1] = lo;
+}
+
+static void
+chip8_draw(struct CHIP8 *chip8, uint8_t X, uint8_t Y, uint8_t N)
+{
+	size_t coord_x = chip8->vregs[X] & (D_WIDTH-1);
+	size_t coord_y = chip8->vregs[Y] & (D_HEIGHT-1);
+	chip8->vregs[15] = 0;
+
+	size_t i = chip8->I;
+	size_t xd = N == 0 ? 16 : 8;
+	size_t yd = N == 0 ? 16 : N;
+
+	for (size_t plane = 0; plane < 2; ++plane) {
+		if ((chip8->plane & (plane + 1)) == 0) continue;
+
+		for (size_t y = 0; y < yd; ++y) {
+			uint64_t sprite = N == 0
+				? (chip8->memory[(i + (2 * y)) & CHIP8_MEM_MASK] << 8)
+				  | chip8->memory[(i + (2 * y) + 1) & CHIP8_MEM_MASK]
+				: chip8->memory[(i + y) & CHIP8_MEM_MASK];
+
+			uint64_t mask[2];
+			chip8_sprite_row(sprite, xd, coord_x, D_WIDTH, mask);
+
+			// XORing in a blank sprite row changes nothing.
+			size_t dy = (y + coord_y) & (D_HEIGHT-1);
+			if (mask[0] | mask[1])
+				chip8->dirty_rows |= (uint64_t)1 << dy;
+
+			uint64_t *row = chip8->display[plane][dy];
+			if ((row[0] & mask[0]) | (row[1] & mask[1]))
+				chip8->vregs[15] = 1;
+			row[0] ^= mask[0];
+			row[1] ^= mask[1];
+		}
+		i += N == 0 ? 32 : N;
+	}
+}
+
+// Save registers VX..=VY (VX..=VY may run backwards) to memory starting at I.
+static void
+chip8_save(struct CHIP8 *chip8, uint8_t X, uint8_t Y)
+{
+	size_t n = (X < Y ? Y - X : X - Y) + 1;
+	for (size_t i = 0; i < n; ++i)
+		chip8->memory[(chip8->I + i) & CHIP8_MEM_MASK] = chip8->vregs[X < Y ? X + i : X - i];
+	chip8_invalidate(chip8, chip8->I, n);
+}
+
+// Load registers VX..=VY (VX..=VY may run backwards) from memory starting at I.
+static void
+chip8_restore(struct CHIP8 *chip8, uint8_t X, uint8_t Y)
+{
+	size_t n = (X < Y ? Y - X : X - Y) + 1;
+	for (size_t i = 0; i < n; ++i)
+		chip8->vregs[X < Y ? X + i : X - i] = chip8->memory[(chip8->I + i) & CHIP8_MEM_MASK];
+}
+
+// Load the audio pattern from the 16 bytes at I.
+static void
+chip8_save_pattern(struct CHIP8 *chip8)
+{
+	for (size_t i = 0; i < sizeof(chip8->pattern); ++i)
+		chip8->pattern[i] = chip8->memory[(chip8->I + i) & CHIP8_MEM_MASK];
+}
+
+static void
+chip8_bcd(struct CHIP8 *chip8, uint8_t X)
+{
+	uint8_t value = chip8->vregs[X];
+	chip8->memory[(chip8->I + 0) & CHIP8_MEM_MASK] = value / 100;
+	chip8->memory[(chip8->I + 1) & CHIP8_MEM_MASK] = (value / 10) % 10;
+	chip8->memory[(chip8->I + 2) & CHIP8_MEM_MASK] = value % 10;
+	chip8_invalidate(chip8, chip8->I, 3);
+}
+
+#ifdef CHIP8_PROFILER
+static const char *profile_names[I_MAX] = {
+	[I_00CN] = "00CN", [I_00DN] = "00DN", [I_00E0] = "00E0", [I_00EE] = "00EE",
+	[I_00FB] = "00FB", [I_00FC] = "00FC", [I_00FD] = "00FD", [I_00FE] = "00FE",
+	[I_00FF] = "00FF", [I_1NNN] = "1NNN", [I_2NNN] = "2NNN", [I_3XNN] = "3XNN",
+	[I_4XNN] = "4XNN", [I_5XY0] = "5XY0", [I_5XY2] = "5XY2", [I_5XY3] = "5XY3",
+	[I_6XNN] = "6XNN", [I_7XNN] = "7XNN", [I_8XY0] = "8XY0", [I_8XY1] = "8XY1",
+	[I_8XY2] = "8XY2", [I_8XY3] = "8XY3", [I_8XY4] = "8XY4", [I_8XY5] = "8XY5",
+	[I_8X06] = "8X06", [I_8XY7] = "8XY7", [I_8X0E] = "8X0E", [I_9XY0] = "9XY0",
+	[I_ANNN] = "ANNN", [I_BNNN] = "BNNN", [I_CXNN] = "CXNN", [I_DXYN] = "DXYN",
+	[I_EX9E] = "EX9E", [I_EXA1] = "EXA1", [I_F000] = "F000", [I_FX01] = "FX01",
+	[I_F002] = "F002", [I_FX07] = "FX07", [I_FX15] = "FX15", [I_FX18] = "FX18",
+	[I_FX29] = "FX29", [I_FX30] = "FX30", [I_FX1E] = "FX1E", [I_FX0A] = "FX0A",
+	[I_FX33] = "FX33", [I_FX55] = "FX55", [I_FX65] = "FX65", [I_FX75] = "FX75",
+	[I_FX85] = "FX85", [I_FX3A] = "FX3A",
+};
+
+// Start counting, or start over, from the next instruction on, keeping
+// the labels and sampling rate. While a machine is being profiled
+// chip8_run() ignores its engine and steps it with chip8_step(), the only
+// one that counts.
+void
+chip8_profile_start(struct CHIP8 *chip8)
+{
+	struct CHIP8_profile *p = chip8->profile;
+	size_t every = CHIP8_PROFILE_SAMPLE;
+	char **labels = NULL;
+
+	if (p == NULL) {
+		p = chip8->profile = ecalloc(1, sizeof(struct CHIP8_profile));
+	} else {
+		every = p->sample_every;
+		labels = p->labels;
+		free(p->samples);
+		memset(p, 0, sizeof(struct CHIP8_profile));
+	}
+
+	p->labels = labels;
+	chip8_profile_sample(chip8, every);
+}
+
+void
+chip8_profile_stop(struct CHIP8 *chip8)
+{
+	struct CHIP8_profile *p = chip8->profile;
+	if (p == NULL)
+		return;
+
+	if (p->labels != NULL)
+		for (size_t addr = 0; addr < CHIP8_MEM_SIZE; ++addr)
+			free(p->labels[addr]);
+	free(p->labels);
+	free(p->samples);
+	free(p);
+	chip8->profile = NULL;
+}
+
+// Sample the call stack every `every` instructions from now on, or never
+// if 0.
+void
+chip8_profile_sample(struct CHIP8 *chip8, size_t every)
+{
+	if (chip8->profile == NULL)
+		return;
+
+	chip8->profile->sample_every = every;
+	chip8->profile->sample_in = every;
+}
+
+// Name addresses after the lines of `path` that give an address and a
+// name, such as "0x2A4 draw_player". Lines starting with # are skipped.
+// Returns false if the file can't be read, or the machine isn't being
+// profiled.
+bool
+chip8_profile_labels(struct CHIP8 *chip8, const char *path)
+{
+	if (chip8->profile == NULL)
+		return false;
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		return false;
+
+	struct CHIP8_profile *p = chip8->profile;
+	if (p->labels == NULL)
+		p->labels = ecalloc(CHIP8_MEM_SIZE, sizeof(*p->labels));
+
+	char line[256], name[256];
+	long addr;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%li %255s", &addr, name) != 2)
+			continue;
+
+		// Semicolons separate frames in chip8_profile_fold()'s output.
+		for (char *c = name; *c != '\0'; ++c)
+			if (*c == ';') *c = '_';
+
+		addr &= CHIP8_MEM_MASK;
+		free(p->labels[addr]);
+		p->labels[addr] = ecalloc(strlen(name) + 1, sizeof(char));
+		strcpy(p->labels[addr], name);
+	}
+
+	fclose(fp);
+	return true;
+}
+
+static uint64_t
+chip8_profile_hash(const struct CHIP8_stack_sample *s)
+{
+	return fnv1a(s->frames, s->depth * sizeof(*s->frames), FNV1A_INIT);
+}
+
+// The slot of the table `s` is in, or would go in.
+static struct CHIP8_stack_sample *
+chip8_profile_slot(struct CHIP8_profile *p, const struct CHIP8_stack_sample *s)
+{
+	size_t mask = p->samples_cap - 1;
+	for (size_t i = chip8_profile_hash(s) & mask;; i = (i + 1) & mask) {
+		struct CHIP8_stack_sample *slot = &p->samples[i];
+		if (slot->count == 0 || (slot->depth == s->depth
+		    && memcmp(slot->frames, s->frames, s->depth * sizeof(*s->frames)) == 0))
+			return slot;
+	}
+}
+
+// Count the call stack that the instruction at `pc` is about to run in.
+// The stack holds return addresses; the 2NNN before each one says which
+// subroutine the frame above it is in.
+//
+// SC wraps around the ring on overflow and underflow, so it isn't the
+// depth. 00EE zeroes the slot it pops, though, so the live frames are
+// the ones from SC back to the first zeroed slot, and at most the whole
+// ring after more nested calls than it holds.
+static void
+chip8_profile_stack(struct CHIP8 *chip8, size_t pc)
+{
+	struct CHIP8_profile *p = chip8->profile;
+
+	size_t live = 0;
+	while (live < CHIP8_STACK_SIZE
+	    && chip8->stack[(chip8->SC - 1 - live) & CHIP8_STACK_MASK] != 0)
+		live += 1;
+
+	struct CHIP8_stack_sample s = { .count = 0, .depth = 0 };
+	for (size_t i = chip8->SC - live; s.depth < live; ++i) {
+		size_t call = (chip8->stack[i & CHIP8_STACK_MASK] - 2) & CHIP8_MEM_MASK;
+		uint16_t op = (chip8->memory[call] << 8) | chip8->memory[(call + 1) & CHIP8_MEM_MASK];
+		s.frames[s.depth++] = (op >> 12) == 0x2 ? op & 0xFFF : call;
+	}
+	s.frames[s.depth++] = pc;
+
+	if (p->nsamples * 2 >= p->samples_cap) {
+		struct CHIP8_stack_sample *old = p->samples;
+		size_t old_cap = p->samples_cap;
+
+		p->samples_cap = old_cap == 0 ? 1024 : old_cap * 2;
+		p->samples = ecalloc(p->samples_cap, sizeof(*p->samples));
+		for (size_t i = 0; i < old_cap; ++i)
+			if (old[i].count != 0)
+				*chip8_profile_slot(p, &old[i]) = old[i];
+		free(old);
+	}
+
+	struct CHIP8_stack_sample *slot = chip8_profile_slot(p, &s);
+	if (slot->count == 0) {
+		*slot = s;
+		p->nsamples += 1;
+	}
+	slot->count += 1;
+}
+
+// TSC ticks where there is one, nanoseconds elsewhere.
+static inline uint64_t
+chip8_profile_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+static inline bool
+chip8_profile_timed(enum CHIP8_inst_type type)
+{
+	return type == I_DXYN || type == I_00CN || type == I_00DN
+	    || type == I_00FB || type == I_00FC;
+}
+
+// Count the instruction about to run at `pc`, and return the time it
+// started if it's one whose time is counted as well.
+static inline uint64_t
+chip8_profile_enter(struct CHIP8 *chip8, size_t pc, enum CHIP8_inst_type type)
+{
+	struct CHIP8_profile *p = chip8->profile;
+	if (p == NULL || type >= I_MAX)
+		return 0;
+
+	p->ops += 1;
+	p->types[type] += 1;
+	p->last[type] = p->ops;
+	p->pcs[pc] += 1;
+
+	if (p->sample_every != 0 && --p->sample_in == 0) {
+		p->sample_in = p->sample_every;
+		chip8_profile_stack(chip8, pc);
+	}
+
+	return chip8_profile_timed(type) ? chip8_profile_clock() : 0;
+}
+
+// Count how the instruction that just ran went: `next` is the instruction
+// after it, which a skip taken jumps over.
+static inline void
+chip8_profile_leave(struct CHIP8 *chip8, enum CHIP8_inst_type type, size_t next, uint64_t start)
+{
+	struct CHIP8_profile *p = chip8->profile;
+	if (p == NULL)
+		return;
+
+	switch (type) {
+	break; case I_3XNN: case I_4XNN: case I_5XY0: case I_9XY0: case I_EX9E: case I_EXA1:
+		p->skips[type][chip8->PC != next] += 1;
+	break; case I_DXYN:
+		p->draw_cycles += chip8_profile_clock() - start;
+	break; case I_00CN: case I_00DN: case I_00FB: case I_00FC:
+		p->scroll_cycles += chip8_profile_clock() - start;
+	break; default:
+		break;
+	}
+}
+
+struct profile_pc {
+	uint64_t count;
+	size_t   pc;
+};
+
+static int
+profile_hotter(const void *a, const void *b)
+{
+	const struct profile_pc *x = a, *y = b;
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return x->pc < y->pc ? -1 : 1;
+}
+
+// Write the profile to `path` as lines of whitespace-separated fields, the first
+// of which says what the rest are:
+//
+//   instructions <total>
+//   cycles <DXYN|scroll> <total> <per instruction>
+//   type <type> <count> <percent of instructions>
+//   skip <type> <taken> <not taken>
+//   pc <address> <count> <type>
+//
+// Types and addresses that never ran are left out, and addresses come
+// hottest first, so `grep ^pc | head` shows where a ROM spends its time.
+void
+chip8_profile_dump(struct CHIP8 *chip8, const char *path)
+{
+	struct CHIP8_profile *p = chip8->profile;
+	if (p == NULL)
+		return;
+
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		log("Could not write profile to %s: %s", path, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, "instructions %" PRIu64 "\n", p->ops);
+	fprintf(fp, "cycles DXYN %" PRIu64 " %.1f\n", p->draw_cycles, p->types[I_DXYN] == 0 ? 0.0
+		: (double)p->draw_cycles / p->types[I_DXYN]);
+	uint64_t scrolls = p->types[I_00CN] + p->types[I_00DN] + p->types[I_00FB] + p->types[I_00FC];
+	fprintf(fp, "cycles scroll %" PRIu64 " %.1f\n", p->scroll_cycles, scrolls == 0 ? 0.0
+		: (double)p->scroll_cycles / scrolls);
+
+	for (size_t t = 0; t < I_MAX; ++t)
+		if (p->types[t] != 0)
+			fprintf(fp, "type %s %" PRIu64 " %.2f\n", profile_names[t], p->types[t],
+				100.0 * p->types[t] / p->ops);
+
+	for (size_t t = 0; t < I_MAX; ++t)
+		if (p->skips[t][0] + p->skips[t][1] != 0)
+			fprintf(fp, "skip %s %" PRIu64 " %" PRIu64 "\n", profile_names[t],
+				p->skips[t][1], p->skips[t][0]);
+
+	size_t n = 0;
+	struct profile_pc *hot = ecalloc(CHIP8_MEM_SIZE, sizeof(*hot));
+	for (size_t pc = 0; pc < CHIP8_MEM_SIZE; ++pc)
+		if (p->pcs[pc] != 0)
+			hot[n++] = (struct profile_pc){ p->pcs[pc], pc };
+	qsort(hot, n, sizeof(*hot), profile_hotter);
+
+	for (size_t i = 0; i < n; ++i) {
+		enum CHIP8_inst_type type = chip8_next(chip8, hot[i].pc).type;
+		fprintf(fp, "pc 0x%04zX %" PRIu64 " %s\n", hot[i].pc, hot[i].count,
+			type < I_MAX ? profile_names[type] : "?");
+	}
+	free(hot);
+
+	fclose(fp);
+	log("Profile written to %s", path);
+}
+
+// Write `addr` as a frame: the nearest label at or below it, and how far
+// past it, or else the address itself.
+static void
+chip8_profile_frame(struct CHIP8_profile *p, FILE *fp, size_t addr)
+{
+	if (p->labels != NULL)
+		for (size_t a = addr + 1; a-- > 0;)
+			if (p->labels[a] != NULL) {
+				if (a == addr)
+					fprintf(fp, "%s", p->labels[a]);
+				else
+					fprintf(fp, "%s+0x%zX", p->labels[a], addr - a);
+				return;
+			}
+	fprintf(fp, "0x%zX", addr);
+}
+
+// Write the call stacks sampled to `path` in the folded format flame graph
+// tools read: a line per stack, its frames outermost first separated by
+// semicolons and then how many samples it was in, such as
+// "0x200;0x2A4;0x31C 1234". The outermost frame is always ROM_START, the
+// main program; the innermost is the instruction that was about to run.
+void
+chip8_profile_fold(struct CHIP8 *chip8, const char *path)
+{
+	struct CHIP8_profile *p = chip8->profile;
+	if (p == NULL || p->nsamples == 0)
+		return;
+
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL) {
+		log("Could not write call stacks to %s: %s", path, strerror(errno));
+		return;
+	}
+
+	for (size_t i = 0; i < p->samples_cap; ++i) {
+		struct CHIP8_stack_sample *s = &p->samples[i];
+		if (s->count == 0)
+			continue;
+
+		chip8_profile_frame(p, fp, ROM_START);
+		for (size_t f = 0; f < s->depth; ++f) {
+			fputc(';', fp);
+			chip8_profile_frame(p, fp, s->frames[f]);
+		}
+		fprintf(fp, " %" PRIu64 "\n", s->count);
+	}
+
+	fclose(fp);
+	log("Call stacks written to %s", path);
+}
+
+#define PROFILING(chip8) ((chip8)->profile != NULL)
+#define PROFILE_ENTER(chip8, pc, type) \
+	uint16_t profile_next = (chip8)->PC; \
+	uint64_t profile_start = chip8_profile_enter(chip8, pc, type)
+#define PROFILE_LEAVE(chip8, type) \
+	chip8_profile_leave(chip8, type, profile_next, profile_start)
+#else
+#define PROFILING(chip8) false
+#define PROFILE_ENTER(chip8, pc, type)
+#define PROFILE_LEAVE(chip8, type)
+#endif
+
 void
 chip8_step(struct CHIP8 *chip8)
 {
@@ -225,81 +906,58 @@ chip8_step(struct CHIP8 *chip8)
 		return;
 	}
 
-	struct CHIP8_inst inst = chip8_next(chip8, chip8->PC);
-	uint8_t     X = inst.X;
-	uint8_t     Y = inst.Y;
-	uint8_t     N = inst.N;
-	uint8_t    NN = inst.NN;
-	uint16_t  NNN = inst.NNN;
-	uint16_t NNNN = inst.NNNN;
+	size_t instPC = chip8->PC & CHIP8_MEM_MASK;
+	uint16_t   op = (chip8->memory[instPC] << 8) | chip8->memory[(instPC + 1) & CHIP8_MEM_MASK];
+	uint8_t     X = (op >>  8) & 0xF;
+	uint8_t     Y = (op >>  4) & 0xF;
+	uint8_t     N = (op >>  0) & 0xF;
+	uint8_t    NN = (op >>  0) & 0xFF;
+	uint16_t  NNN = (op >>  0) & 0xFFF;
 
-	size_t instPC = chip8->PC;
-	chip8->PC += inst.op_len;
+	chip8->PC += op == 0xF000 ? 4 : 2;
 
 	bool set_vf = false;
 
-	switch (inst.type) {
+	enum CHIP8_inst_type type = chip8_type(op);
+	PROFILE_ENTER(chip8, instPC, type);
+	switch (type) {
 	break; case I_00CN:
-			for (ssize_t y = D_HEIGHT - 1; y >= 0; --y) {
-				for (ssize_t x = 0; x < D_WIDTH; ++x) {
-					chip8_mvpx(chip8, x, y, x, y - N);
-				}
-			}
+			chip8_scroll_down(chip8, N);
 	break; case I_00DN:
-			for (ssize_t y = 0; y < D_HEIGHT; ++y) {
-				for (size_t x = 0; x < D_WIDTH; ++x) {
-					chip8_mvpx(chip8, x, y, x, y + N);
-				}
-			}
+			chip8_scroll_up(chip8, N);
 	break; case I_00E0:
-				chip8->redraw = true;
-				for (size_t i = 0; i < sizeof(chip8->display); ++i)
-					chip8->display[i] &= ~chip8->plane;
+				chip8_clear(chip8);
 	break; case I_00EE:
-				// TODO: handle underflow
-				chip8->SC -= 1;
+				chip8->SC = (chip8->SC - 1) & CHIP8_STACK_MASK;
 				chip8->PC = chip8->stack[chip8->SC];
 				chip8->stack[chip8->SC] = 0;
 	break; case I_00FB:
-				for (ssize_t y = 0; y < D_HEIGHT; ++y)
-					for (ssize_t x = D_WIDTH - 1; x >= 0; --x)
-						chip8_mvpx(chip8, x, y, x - 4, y);
+				chip8_scroll_right(chip8);
 	break; case I_00FC:
-				for (ssize_t y = 0; y < D_HEIGHT; ++y)
-					for (ssize_t x = 0; x < D_WIDTH; ++x)
-						chip8_mvpx(chip8, x, y, x + 4, y);
+				chip8_scroll_left(chip8);
 	break; case I_00FD:
-				chip8->halt = true;
+				chip8->halt = HALT_00FD;
 	break; case I_00FE:
-				chip8->hires = false;
-				memset(chip8->display, 0x0, sizeof(chip8->display));
+				chip8_set_hires(chip8, false);
 	break; case I_00FF:
-				chip8->hires = true;
-				memset(chip8->display, 0x0, sizeof(chip8->display));
+				chip8_set_hires(chip8, true);
 	break; case I_1NNN:
 		chip8->PC = NNN;
 	break; case I_2NNN:
-		// TODO: handle overflow
 		chip8->stack[chip8->SC] = chip8->PC;
-		chip8->SC += 1;
+		chip8->SC = (chip8->SC + 1) & CHIP8_STACK_MASK;
 		chip8->PC = NNN;
 	break; case I_3XNN:
-	if (chip8->vregs[X] == NN) chip8->PC += chip8_next(chip8, chip8->PC).op_len;
+	if (chip8->vregs[X] == NN) chip8->PC += chip8_op_len(chip8, chip8->PC);
 	break; case I_4XNN:
-		if (chip8->vregs[X] != NN) chip8->PC += chip8_next(chip8, chip8->PC).op_len;
+		if (chip8->vregs[X] != NN) chip8->PC += chip8_op_len(chip8, chip8->PC);
 	break; case I_5XY0:
 			if (chip8->vregs[X] == chip8->vregs[Y])
-				chip8->PC += chip8_next(chip8, chip8->PC).op_len;
+				chip8->PC += chip8_op_len(chip8, chip8->PC);
 	break; case I_5XY2:
-			for (size_t i = 0; i <= abs((ssize_t)X - (ssize_t)Y); ++i) {
-				size_t r = X < Y ? X + i : X - i;
-				chip8->memory[chip8->I + i] = chip8->vregs[r];
-			}
+			chip8_save(chip8, X, Y);
 	break; case I_5XY3:
-			for (size_t i = 0; i <= abs((ssize_t)X - (ssize_t)Y); ++i) {
-				size_t r = X < Y ? X + i : X - i;
-				chip8->vregs[r] = chip8->memory[chip8->I + i];
-			}
+			chip8_restore(chip8, X, Y);
 	break; case I_6XNN:
 		chip8->vregs[X] = NN;
 	break; case I_7XNN:
@@ -335,7 +993,7 @@ chip8_step(struct CHIP8 *chip8)
 			chip8->vregs[X] <<= 1;
 	break; case I_9XY0:
 		if (chip8->vregs[X] != chip8->vregs[Y])
-			chip8->PC += chip8_next(chip8, chip8->PC).op_len;
+			chip8->PC += chip8_op_len(chip8, chip8->PC);
 	break; case I_ANNN:
 		chip8->I = NNN;
 	break; case I_BNNN:
@@ -343,54 +1001,19 @@ chip8_step(struct CHIP8 *chip8)
 		chip8->PC = NNN + chip8->vregs[0];
 		//chip8->PC = NNN + chip8->vregs[X];
 	break; case I_CXNN:
-		chip8->vregs[X] = rand() & NN;
+		chip8->vregs[X] = chip8_random(chip8) & NN;
 	break; case I_DXYN:
-		chip8->redraw = true;
-		size_t coord_x = chip8->vregs[X] & (D_WIDTH-1);
-		size_t coord_y = chip8->vregs[Y] & (D_HEIGHT-1);
-		chip8->vregs[15] = 0;
-
-		size_t i = chip8->I;
-		size_t xd = N == 0 ? 16 : 8;
-		size_t yd = N == 0 ? 16 : N;
-
-		for (size_t color = 1; color <= 2; ++color) {
-			if ((chip8->plane & color) == 0) continue;
-
-			for (size_t y = 0; y < yd; ++y) for (size_t x = 0; x < xd; ++x) {
-				size_t p = N == 0 ? (chip8->memory[i + (2 * y) + (x > 7 ? 1 : 0)] >> (7 - (x % 8)))
-				                  : (chip8->memory[i +      y                   ] >> (7 - x      ));
-				p &= 1;
-
-				size_t pos_x = (x + coord_x) & (D_WIDTH-1);
-				size_t pos_y = (y + coord_y) & (D_HEIGHT-1);
-				size_t pos = (D_WIDTH * pos_y) + pos_x;
-
-				if (p) {
-					uint8_t *pixel = &chip8->display[pos];
-					if ((color & *pixel) == 0) { // set
-						*pixel |= color;
-					} else { // clear
-						*pixel &= ~color;
-						chip8->vregs[15] = 1;
-					}
-				}
-				
-			}
-			i += N == 0 ? 32 : N;
-		}
-	break; case I_EX9E: {
-		uint8_t key = chip8->vregs[X] & 0xF;
-			if ((chip8->keydown_fn)(key)) chip8->PC += 2;
-	} break; case I_EXA1: {
-		uint8_t key = chip8->vregs[X] & 0xF;
-			if (!(chip8->keydown_fn)(key)) chip8->PC += 2;
-	} break; case I_F000:
-			chip8->I = NNNN;
+		chip8_draw(chip8, X, Y, N);
+	break; case I_EX9E:
+			if ((chip8->keypad >> (chip8->vregs[X] & 0xF)) & 1) chip8->PC += 2;
+	break; case I_EXA1:
+			if (!((chip8->keypad >> (chip8->vregs[X] & 0xF)) & 1)) chip8->PC += 2;
+	break; case I_F000:
+			chip8->I = chip8_next(chip8, instPC).NNNN;
 	break; case I_FX01:
 			chip8->plane = X & 3;
 	break; case I_F002:
-			// TODO: audio
+			chip8_save_pattern(chip8);
 	break; case I_FX07:
 			chip8->vregs[X] = chip8->delay_tmr;
 	break; case I_FX15:
@@ -408,32 +1031,215 @@ chip8_step(struct CHIP8 *chip8)
 	break; case I_FX0A:
 			chip8->wait_key = X;
 	break; case I_FX33:
-			;
-			uint8_t value = chip8->vregs[X];
-			chip8->memory[chip8->I + 0] = value / 100;
-			chip8->memory[chip8->I + 1] = (value / 10) % 10;
-			chip8->memory[chip8->I + 2] = value % 10;
+			chip8_bcd(chip8, X);
 	break; case I_FX55:
 			// TODO: configurable behaviour to increment I with r
-			for (size_t r = 0; r <= X; ++r)
-				chip8->memory[chip8->I + r] = chip8->vregs[r];
+			chip8_save(chip8, 0, X);
 	break; case I_FX65:
 			// TODO: configurable behaviour to increment I with r
-			for (size_t r = 0; r <= X; ++r)
-				chip8->vregs[r] = chip8->memory[chip8->I + r];
+			chip8_restore(chip8, 0, X);
 	break; case I_FX75:
 			for (size_t r = 0; r <= X; ++r)
 				chip8->fregs[r] = chip8->vregs[r];
 	break; case I_FX85:
 			for (size_t r = 0; r <= X; ++r)
 				chip8->vregs[r] = chip8->fregs[r];
+	break; case I_FX3A:
+			chip8->pitch = chip8->vregs[X];
 	break; case I_UNKNOWN:
-		log("Unknown opcode %04X at PC %04X", inst.op, instPC);
-		chip8->halt = true;
+		log("Unknown opcode %04X at PC %04zX", op, instPC);
+		chip8->halt = HALT_UNKNOWN_OP;
 	break; default:
-		log("Internal error: chip8_next returned unknown opcode %04X", inst.op);
-		chip8->halt = true;
+		log("Internal error: chip8_decode returned unknown opcode %04X", op);
+		chip8->halt = HALT_UNKNOWN_OP;
 	break;
 	};
 
+	PROFILE_LEAVE(chip8, type);
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// Direct-threaded version of calling chip8_step() in a loop. Each handler
+// fetches the next instruction's type from the decode cache and jumps
+// straight to its handler (computed goto), so every opcode ends in its own
+// indirect branch instead of all of them sharing the one in the switch.
+// halt/wait_key are only checked after the instructions that can set them.
+//
+static size_t
+chip8_run_threaded(struct CHIP8 *chip8, size_t count)
+{
+	static const void *const handlers[] = {
+		[I_00CN] = &&L_00CN, [I_00DN] = &&L_00DN, [I_00E0] = &&L_00E0,
+		[I_00EE] = &&L_00EE, [I_00FB] = &&L_00FB, [I_00FC] = &&L_00FC,
+		[I_00FD] = &&L_00FD, [I_00FE] = &&L_00FE, [I_00FF] = &&L_00FF,
+		[I_1NNN] = &&L_1NNN, [I_2NNN] = &&L_2NNN, [I_3XNN] = &&L_3XNN,
+		[I_4XNN] = &&L_4XNN, [I_5XY0] = &&L_5XY0, [I_5XY2] = &&L_5XY2,
+		[I_5XY3] = &&L_5XY3, [I_6XNN] = &&L_6XNN, [I_7XNN] = &&L_7XNN,
+		[I_8XY0] = &&L_8XY0, [I_8XY1] = &&L_8XY1, [I_8XY2] = &&L_8XY2,
+		[I_8XY3] = &&L_8XY3, [I_8XY4] = &&L_8XY4, [I_8XY5] = &&L_8XY5,
+		[I_8X06] = &&L_8X06, [I_8XY7] = &&L_8XY7, [I_8X0E] = &&L_8X0E,
+		[I_9XY0] = &&L_9XY0, [I_ANNN] = &&L_ANNN, [I_BNNN] = &&L_BNNN,
+		[I_CXNN] = &&L_CXNN, [I_DXYN] = &&L_DXYN, [I_EX9E] = &&L_EX9E,
+		[I_EXA1] = &&L_EXA1, [I_F000] = &&L_F000, [I_FX01] = &&L_FX01,
+		[I_F002] = &&L_F002, [I_FX07] = &&L_FX07, [I_FX15] = &&L_FX15,
+		[I_FX18] = &&L_FX18, [I_FX29] = &&L_FX29, [I_FX30] = &&L_FX30,
+		[I_FX1E] = &&L_FX1E, [I_FX0A] = &&L_FX0A, [I_FX33] = &&L_FX33,
+		[I_FX55] = &&L_FX55, [I_FX65] = &&L_FX65, [I_FX75] = &&L_FX75,
+		[I_FX85] = &&L_FX85, [I_FX3A] = &&L_FX3A, [I_MAX] = &&L_UNKNOWN,
+		[I_UNKNOWN] = &&L_UNKNOWN,
+	};
+
+	size_t executed = 0;
+	size_t instPC;
+	uint16_t op;
+	uint8_t X, Y, N, NN;
+	uint16_t NNN;
+	bool set_vf;
+
+#define DISPATCH() do {                                                     \
+		if (executed == count) goto done;                           \
+		++executed;                                                 \
+		instPC = chip8->PC & CHIP8_MEM_MASK;                        \
+		op  = (chip8->memory[instPC] << 8)                          \
+		    | chip8->memory[(instPC + 1) & CHIP8_MEM_MASK];         \
+		X   = (op >>  8) & 0xF;                                     \
+		Y   = (op >>  4) & 0xF;                                     \
+		N   = (op >>  0) & 0xF;                                     \
+		NN  = (op >>  0) & 0xFF;                                    \
+		NNN = (op >>  0) & 0xFFF;                                   \
+		chip8->PC += op == 0xF000 ? 4 : 2;                          \
+		goto *handlers[chip8_type(op)];                             \
+	} while (0)
+
+	if (chip8->halt || chip8->wait_key != -1)
+		return 0;
+
+	DISPATCH();
+
+L_00CN: chip8_scroll_down(chip8, N);  DISPATCH();
+L_00DN: chip8_scroll_up(chip8, N);    DISPATCH();
+L_00E0: chip8_clear(chip8);           DISPATCH();
+L_00EE:
+	chip8->SC = (chip8->SC - 1) & CHIP8_STACK_MASK;
+	chip8->PC = chip8->stack[chip8->SC];
+	chip8->stack[chip8->SC] = 0;
+	DISPATCH();
+L_00FB: chip8_scroll_right(chip8);    DISPATCH();
+L_00FC: chip8_scroll_left(chip8);     DISPATCH();
+L_00FD: chip8->halt = HALT_00FD;      goto done;
+L_00FE: chip8_set_hires(chip8, false); DISPATCH();
+L_00FF: chip8_set_hires(chip8, true);  DISPATCH();
+L_1NNN: chip8->PC = NNN;              DISPATCH();
+L_2NNN:
+	chip8->stack[chip8->SC] = chip8->PC;
+	chip8->SC = (chip8->SC + 1) & CHIP8_STACK_MASK;
+	chip8->PC = NNN;
+	DISPATCH();
+L_3XNN:
+	if (chip8->vregs[X] == NN) chip8->PC += chip8_op_len(chip8, chip8->PC);
+	DISPATCH();
+L_4XNN:
+	if (chip8->vregs[X] != NN) chip8->PC += chip8_op_len(chip8, chip8->PC);
+	DISPATCH();
+L_5XY0:
+	if (chip8->vregs[X] == chip8->vregs[Y]) chip8->PC += chip8_op_len(chip8, chip8->PC);
+	DISPATCH();
+L_5XY2: chip8_save(chip8, X, Y);      DISPATCH();
+L_5XY3: chip8_restore(chip8, X, Y);   DISPATCH();
+L_6XNN: chip8->vregs[X] = NN;         DISPATCH();
+L_7XNN: chip8->vregs[X] += NN;        DISPATCH();
+L_8XY0: chip8->vregs[X] = chip8->vregs[Y];  DISPATCH();
+L_8XY1: chip8->vregs[X] |= chip8->vregs[Y]; DISPATCH();
+L_8XY2: chip8->vregs[X] &= chip8->vregs[Y]; DISPATCH();
+L_8XY3: chip8->vregs[X] ^= chip8->vregs[Y]; DISPATCH();
+L_8XY4: {
+	size_t result = chip8->vregs[X] + chip8->vregs[Y];
+	if (result > 255) chip8->vregs[15] = 1;
+	chip8->vregs[X] = result & 0xFF;
+	DISPATCH();
+}
+L_8XY5:
+	set_vf = chip8->vregs[X] >= chip8->vregs[Y];
+	chip8->vregs[X] -= chip8->vregs[Y];
+	chip8->vregs[15] = set_vf;
+	DISPATCH();
+L_8X06:
+	chip8->vregs[15] = chip8->vregs[X] & 1;
+	chip8->vregs[X] >>= 1;
+	DISPATCH();
+L_8XY7:
+	set_vf = chip8->vregs[Y] >= chip8->vregs[X];
+	chip8->vregs[X] = chip8->vregs[Y] - chip8->vregs[X];
+	chip8->vregs[15] = set_vf;
+	DISPATCH();
+L_8X0E:
+	chip8->vregs[15] = (chip8->vregs[X] & 0x80) != 0;
+	chip8->vregs[X] <<= 1;
+	DISPATCH();
+L_9XY0:
+	if (chip8->vregs[X] != chip8->vregs[Y]) chip8->PC += chip8_op_len(chip8, chip8->PC);
+	DISPATCH();
+L_ANNN: chip8->I = NNN;                          DISPATCH();
+L_BNNN: chip8->PC = NNN + chip8->vregs[0];       DISPATCH();
+L_CXNN: chip8->vregs[X] = chip8_random(chip8) & NN; DISPATCH();
+L_DXYN: chip8_draw(chip8, X, Y, N);              DISPATCH();
+L_EX9E:
+	if ((chip8->keypad >> (chip8->vregs[X] & 0xF)) & 1) chip8->PC += 2;
+	DISPATCH();
+L_EXA1:
+	if (!((chip8->keypad >> (chip8->vregs[X] & 0xF)) & 1)) chip8->PC += 2;
+	DISPATCH();
+L_F000: chip8->I = chip8_next(chip8, instPC).NNNN;                     DISPATCH();
+L_FX01: chip8->plane = X & 3;                                          DISPATCH();
+L_F002: chip8_save_pattern(chip8);                                     DISPATCH();
+L_FX07: chip8->vregs[X] = chip8->delay_tmr;                            DISPATCH();
+L_FX15: chip8->delay_tmr = chip8->vregs[X];                            DISPATCH();
+L_FX18: chip8->sound_tmr = chip8->vregs[X];                            DISPATCH();
+L_FX29: chip8->I = FONT_START + (chip8->vregs[X] & 0xF) * 5;           DISPATCH();
+L_FX30: chip8->I = S_FONT_START + (chip8->vregs[X] & 0xF) * 10;        DISPATCH();
+L_FX1E: chip8->I += chip8->vregs[X];                                   DISPATCH();
+L_FX0A: chip8->wait_key = X;                                           goto done;
+L_FX33: chip8_bcd(chip8, X);                                           DISPATCH();
+L_FX55: chip8_save(chip8, 0, X);                                       DISPATCH();
+L_FX65: chip8_restore(chip8, 0, X);                                    DISPATCH();
+L_FX75:
+	for (size_t r = 0; r <= X; ++r)
+		chip8->fregs[r] = chip8->vregs[r];
+	DISPATCH();
+L_FX85:
+	for (size_t r = 0; r <= X; ++r)
+		chip8->vregs[r] = chip8->fregs[r];
+	DISPATCH();
+L_FX3A: chip8->pitch = chip8->vregs[X];                                DISPATCH();
+L_UNKNOWN:
+	log("Unknown opcode %04X at PC %04zX", op, instPC);
+	chip8->halt = HALT_UNKNOWN_OP;
+	goto done;
+
+#undef DISPATCH
+done:
+	return executed;
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+size_t
+chip8_run(struct CHIP8 *chip8, size_t count)
+{
+	if (chip8->engine == ENGINE_JIT && !PROFILING(chip8))
+		return jit_run(chip8, count);
+
+#ifdef __GNUC__
+	if (chip8->engine == ENGINE_THREADED && !PROFILING(chip8))
+		return chip8_run_threaded(chip8, count);
+#endif
+
+	size_t executed = 0;
+	for (; executed < count && !chip8->halt && chip8->wait_key == -1; ++executed)
+		chip8_step(chip8);
+	return executed;
 }
@@ -1,6 +1,7 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -42,6 +43,34 @@ static const uint8_t s_fonts[] = {
 	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
 };
 
+// Memory and call stack sizes of the machine being emulated, picked with
+// MACHINE in the Makefile. CHIP-8 and SCHIP programs can only address 4 KiB;
+// XO-CHIP's F000 NNNN reaches all of 64 KiB. Both must be powers of two:
+// addresses wrap around at the end of memory and the stack is a ring.
+#if defined(CHIP8_MACHINE_CHIP8) || defined(CHIP8_MACHINE_SCHIP)
+#ifndef CHIP8_MEM_SIZE
+#define CHIP8_MEM_SIZE   4096
+#endif
+#ifndef CHIP8_STACK_SIZE
+#define CHIP8_STACK_SIZE 16
+#endif
+#else
+#ifndef CHIP8_MEM_SIZE
+#define CHIP8_MEM_SIZE   65536
+#endif
+#ifndef CHIP8_STACK_SIZE
+#define CHIP8_STACK_SIZE 16
+#endif
+#endif
+
+#define CHIP8_MEM_MASK   (CHIP8_MEM_SIZE - 1)
+#define CHIP8_STACK_MASK (CHIP8_STACK_SIZE - 1)
+
+// Granularity of the dirty-memory tracking used by snapshots.
+#define CHIP8_PAGE_SHIFT 8
+#define CHIP8_PAGE_SIZE  (1 << CHIP8_PAGE_SHIFT)
+#define CHIP8_PAGES      (CHIP8_MEM_SIZE >> CHIP8_PAGE_SHIFT)
+
 #define ROM_START 0x200
 #define FONT_START 0x00
 #define S_FONT_START (0x00 + sizeof(fonts))
@@ -53,28 +82,66 @@ static const uint8_t s_fonts[] = {
 #define D_HEIGHT (chip8->hires ? S_D_HEIGHT : C_D_HEIGHT)
 #define D_WIDTH  (chip8->hires ?  S_D_WIDTH : C_D_WIDTH)
 
-typedef size_t (*keydown_fn_t)(char);
+struct CHIP8_jit;
+struct CHIP8_profile;
+struct CHIP8_snapshot;
+
+enum CHIP8_halt {
+	HALT_NONE = 0,
+	HALT_00FD,       // the ROM executed 00FD
+	HALT_UNKNOWN_OP, // the ROM executed an invalid instruction
+};
+
+enum CHIP8_engine {
+	ENGINE_SWITCH,   // chip8_step() in a loop
+	ENGINE_THREADED, // direct-threaded dispatch, falls back to ENGINE_SWITCH if unsupported
+	ENGINE_JIT,      // x86-64 basic-block translator (see jit.c)
+};
+
+#ifndef CHIP8_DEFAULT_ENGINE
+#define CHIP8_DEFAULT_ENGINE ENGINE_SWITCH
+#endif
 
 struct CHIP8 {
-	uint8_t  memory[65535];
-	uint8_t  display[S_D_HEIGHT * S_D_WIDTH];
-	size_t   plane;
-	size_t   PC;
+	// Everything most instructions touch, in the first cache line.
+	_Alignas(64)
+	uint8_t  vregs[16];
+	uint16_t PC;
 	uint16_t I;
-	uint16_t stack[4096];
-	size_t   SC;
+	uint16_t SC;
 	uint8_t  delay_tmr;
 	uint8_t  sound_tmr;
-	uint8_t  vregs[16];
-	uint8_t  fregs[16];
-	bool     redraw;
-	bool     halt;
+	uint8_t  plane;
 	bool     hires;
-	ssize_t  wait_key;
+	int8_t   wait_key; // register FX0A will store the key in, or -1
+	uint16_t keypad;   // bit N set while key N is held, see chip8_key()
+	enum CHIP8_halt halt;
+	uint64_t rng;      // PCG32 state for CXNN, see chip8_seed()
+	enum CHIP8_engine engine; // used by chip8_run()
+	struct CHIP8_jit *jit;    // allocated on first use of ENGINE_JIT
+
+	uint8_t  fregs[16];
+	uint8_t  pattern[16]; // XO-CHIP audio, 128 1-bit samples MSB first, see F002
+	uint8_t  pitch;       // XO-CHIP playback rate, 4000 * 2^((pitch - 64) / 48) Hz
+	uint64_t dirty_rows; // bit y set if display row y changed since the frontend last drew it
+	uint16_t stack[CHIP8_STACK_SIZE];
+	uint64_t display[2][S_D_HEIGHT][S_D_WIDTH / 64]; // [plane][y][x / 64], MSB leftmost
 
-	keydown_fn_t keydown_fn;
+	// Everything above is copied by snapshot_take(). Below are the
+	// snapshot that memory was last synced with and the pages stored to
+	// since, and then memory, which snapshots share page by page.
+	struct CHIP8_snapshot *snap;
+#ifdef CHIP8_PROFILER
+	struct CHIP8_profile *profile; // see chip8_profile_start(), kept across rewinds
+#endif
+	uint64_t dirty[(CHIP8_PAGES + 63) / 64];
+	uint8_t  memory[CHIP8_MEM_SIZE];
 };
 
+_Static_assert(offsetof(struct CHIP8, fregs) <= 64, "hot fields must fit in one cache line");
+_Static_assert((CHIP8_MEM_SIZE & CHIP8_MEM_MASK) == 0, "CHIP8_MEM_SIZE must be a power of two");
+_Static_assert((CHIP8_STACK_SIZE & CHIP8_STACK_MASK) == 0, "CHIP8_STACK_SIZE must be a power of two");
+
 enum CHIP8_inst_type {
 	I_00CN,
 	I_00DN,
@@ -125,6 +192,7 @@ enum CHIP8_inst_type {
 	I_FX65,
 	I_FX75,
 	I_FX85,
+	I_FX3A,
 	I_MAX,
 	I_UNKNOWN,
 };
@@ -142,9 +210,122 @@ struct CHIP8_inst {
 	uint16_t NNNN;
 };
 
-void chip8_init(struct CHIP8 *chip8, keydown_fn_t keydown);
+#ifdef CHIP8_PROFILER
+// Where the frontends write the profile and the sampled call stacks when
+// they exit.
+#define CHIP8_PROFILE_FILE "ch8.prof"
+#define CHIP8_FOLDED_FILE  "ch8.folded"
+
+// Instructions between call stack samples, unless the frontend says
+// otherwise with chip8_profile_sample().
+#ifndef CHIP8_PROFILE_SAMPLE
+#define CHIP8_PROFILE_SAMPLE 1000
+#endif
+
+// A call stack seen by chip8_profile_enter(), outermost first: the
+// subroutines called and the address running in the innermost of them.
+struct CHIP8_stack_sample {
+	uint64_t count; // 0 in an unused slot
+	uint16_t depth;
+	uint16_t frames[CHIP8_STACK_SIZE + 1];
+};
+
+// Where a machine spends its time, counted by chip8_step() from
+// chip8_profile_start() on. Only built with -DCHIP8_PROFILER (PROFILE=1 in
+// the Makefile): without it neither this nor the counting exists.
+struct CHIP8_profile {
+	uint64_t ops;                  // instructions run
+	uint64_t types[I_MAX];         // instructions run of each type
+	uint64_t last[I_MAX];          // `ops` when each type last ran
+	uint64_t skips[I_MAX][2];      // skips [not taken, taken], by type
+	uint64_t draw_cycles;          // host cycles spent in DXYN
+	uint64_t scroll_cycles;        // host cycles spent in 00CN, 00DN, 00FB and 00FC
+
+	size_t   sample_every;         // instructions between call stack samples, 0 for none
+	size_t   sample_in;            // instructions to the next one
+	struct CHIP8_stack_sample *samples; // open-addressed table of stacks seen
+	size_t   nsamples;
+	size_t   samples_cap;          // a power of two, or 0
+	char   **labels;               // names by address, see chip8_profile_labels()
+
+	uint64_t pcs[CHIP8_MEM_SIZE];  // instructions run at each address
+};
+
+void chip8_profile_start(struct CHIP8 *chip8);
+void chip8_profile_stop(struct CHIP8 *chip8);
+void chip8_profile_sample(struct CHIP8 *chip8, size_t every);
+bool chip8_profile_labels(struct CHIP8 *chip8, const char *path);
+void chip8_profile_dump(struct CHIP8 *chip8, const char *path);
+void chip8_profile_fold(struct CHIP8 *chip8, const char *path);
+#endif
+
+// Bitmask of the planes set at (x, y) of a packed display, such as
+// chip8->display or a copy of it.
+static inline uint8_t
+chip8_display_pixel(uint64_t display[2][S_D_HEIGHT][S_D_WIDTH / 64], size_t x, size_t y)
+{
+	size_t shift = 63 - (x % 64);
+	return ((display[0][y][x / 64] >> shift) & 1)
+	    | (((display[1][y][x / 64] >> shift) & 1) << 1);
+}
+
+// Expand the rows of a packed display set in `rows` into `pixels`, an
+// S_D_WIDTH wide image of colors[] picked by each pixel's planes, with
+// lores pixels doubled to 2x2. Sets the image rows written to
+// [*first, *last) and returns false if there were none.
+static inline bool
+chip8_display_expand(uint64_t display[2][S_D_HEIGHT][S_D_WIDTH / 64], uint64_t rows, bool hires,
+	const uint32_t colors[4], uint32_t *pixels, size_t *first, size_t *last)
+{
+	size_t scale = hires ? 1 : 2;
+	*first = *last = 0;
+
+	for (size_t y = 0; y < S_D_HEIGHT / scale; ++y) {
+		if (((rows >> y) & 1) == 0) continue;
+
+		for (size_t x = 0; x < S_D_WIDTH / scale; ++x) {
+			uint32_t val = colors[chip8_display_pixel(display, x, y)];
+			for (size_t sy = 0; sy < scale; ++sy)
+				for (size_t sx = 0; sx < scale; ++sx)
+					pixels[S_D_WIDTH * (scale * y + sy) + (scale * x + sx)] = val;
+		}
+
+		if (*last == 0) *first = y * scale;
+		*last = (y + 1) * scale;
+	}
+
+	return *last > 0;
+}
+
+// Bitmask of the planes set at (x, y).
+static inline uint8_t
+chip8_pixel(struct CHIP8 *chip8, size_t x, size_t y)
+{
+	return chip8_display_pixel(chip8->display, x, y);
+}
+
+// The next number from CXNN's PCG32 (XSH RR) generator.
+static inline uint32_t
+chip8_random(struct CHIP8 *chip8)
+{
+	uint64_t old = chip8->rng;
+	chip8->rng = old * 6364136223846793005ULL + 1442695040888963407ULL;
+
+	uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+	uint32_t rot = old >> 59;
+	return (xorshifted >> rot) | (xorshifted << (-rot & 31));
+}
+
+void chip8_init(struct CHIP8 *chip8);
+void chip8_seed(struct CHIP8 *chip8, uint64_t seed);
+void chip8_key(struct CHIP8 *chip8, size_t key, bool down);
+void chip8_keypad(struct CHIP8 *chip8, uint16_t keys);
 void chip8_load(struct CHIP8 *chip8, char *data, size_t sz);
+void chip8_tick(struct CHIP8 *chip8);
+void chip8_unpack(struct CHIP8 *chip8, uint8_t *out);
+void chip8_invalidate(struct CHIP8 *chip8, size_t addr, size_t len);
 struct CHIP8_inst chip8_next(struct CHIP8 *chip8, size_t where);
 void chip8_step(struct CHIP8 *chip8);
+size_t chip8_run(struct CHIP8 *chip8, size_t count);
 
 #endif
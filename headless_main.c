@@ -0,0 +1,210 @@
+// Runs a ROM with no display, input or wall-clock pacing: as many
+// instructions as the host can manage, with the timers ticked every
+// `tickrate` instructions as if that many ran per 60 Hz frame. Prints the
+// speed, the final machine state and a hash of the framebuffer, for ROM
+// regression and throughput tests on machines without a display. CXNN
+// draws from a fixed seed, -s, so that a ROM comes out the same every run.
+//
+// With -p, plays back a movie recorded by the SDL frontend instead, with
+// its input, seed and tickrate, and checks that every frame comes out the
+// same as when it was recorded.
+//
+// Built with PROFILE=1, writes a profile of the ROM on exit, with its call
+// stack sampled every -S instructions and named after the labels in -l.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "movie.h"
+#include "util.h"
+
+static uint64_t
+load(struct CHIP8 *chip8, char *filename)
+{
+	struct stat st;
+	if (stat(filename, &st) != 0)
+		die("Could not stat %s:", filename);
+	if ((size_t)st.st_size > sizeof(chip8->memory) - ROM_START)
+		die("%s is too large (%zu bytes)", filename, (size_t)st.st_size);
+
+	char *src = ecalloc(st.st_size, sizeof(char));
+	FILE *src_f = fopen(filename, "rb");
+	if (src_f == NULL)
+		die("Could not open %s:", filename);
+	fread(src, sizeof(char), st.st_size, src_f);
+	fclose(src_f);
+
+	chip8_load(chip8, src, st.st_size);
+	uint64_t hash = fnv1a(src, st.st_size, FNV1A_INIT);
+
+	free(src);
+	return hash;
+}
+
+static double
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+#ifdef CHIP8_PROFILER
+#define PROFILE_OPTS  "S:l:"
+#define PROFILE_USAGE " [-S sample every] [-l labels]"
+#else
+#define PROFILE_OPTS  ""
+#define PROFILE_USAGE ""
+#endif
+
+static void
+usage(char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-n instructions | -f frames | -p movie] [-t tickrate]\n"
+		"       %*s [-e switch|threaded|jit] [-s seed]" PROFILE_USAGE " rom\n",
+		argv0, (int)strlen(argv0), "");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *engines[] = {
+		[ENGINE_SWITCH]   = "switch",
+		[ENGINE_THREADED] = "threaded",
+		[ENGINE_JIT]      = "jit",
+	};
+
+	size_t max_insts = 0;
+	size_t max_frames = 600;
+	size_t tickrate = 1500;
+	ssize_t engine = -1;
+	char *movie_file = NULL;
+	uint64_t seed = 0;
+#ifdef CHIP8_PROFILER
+	size_t sample_every = CHIP8_PROFILE_SAMPLE;
+	char *labels_file = NULL;
+#endif
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:f:p:t:e:s:" PROFILE_OPTS)) != -1) {
+		switch (opt) {
+		break; case 'n':
+			max_insts = strtoull(optarg, NULL, 0);
+			max_frames = 0;
+		break; case 'f':
+			max_frames = strtoull(optarg, NULL, 0);
+			max_insts = 0;
+		break; case 'p':
+			movie_file = optarg;
+		break; case 't':
+			tickrate = strtoull(optarg, NULL, 0);
+		break; case 'e':
+			for (size_t i = 0; i < SIZEOF(engines); ++i)
+				if (!strcmp(optarg, engines[i])) engine = i;
+			if (engine == -1) usage(argv[0]);
+		break; case 's':
+			seed = strtoull(optarg, NULL, 0);
+#ifdef CHIP8_PROFILER
+		break; case 'S':
+			sample_every = strtoull(optarg, NULL, 0);
+		break; case 'l':
+			labels_file = optarg;
+#endif
+		break; default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || tickrate == 0)
+		usage(argv[0]);
+	char *filename = argv[optind];
+
+	static struct CHIP8 chip8;
+	chip8_init(&chip8);
+	chip8_seed(&chip8, seed);
+	if (engine != -1) chip8.engine = engine;
+	uint64_t rom_hash = load(&chip8, filename);
+#ifdef CHIP8_PROFILER
+	chip8_profile_start(&chip8);
+	chip8_profile_sample(&chip8, sample_every);
+	if (labels_file != NULL && !chip8_profile_labels(&chip8, labels_file))
+		die("Could not read labels from %s:", labels_file);
+#endif
+
+	size_t insts = 0;
+	size_t frames = 0;
+
+	struct movie movie;
+	enum movie_status status = MOVIE_END;
+	if (movie_file != NULL) {
+		if (!movie_open(&movie, movie_file))
+			die("Could not read movie %s:", movie_file);
+		if (movie.rom_hash != rom_hash)
+			die("%s was recorded with a different ROM", movie_file);
+	}
+
+	double start = now();
+	if (movie_file != NULL) {
+		status = movie_replay(&movie, &chip8);
+		insts = movie.cycles;
+		frames = movie.frames;
+	} else while (!chip8.halt && chip8.wait_key == -1) {
+		if (max_frames != 0 && frames == max_frames) break;
+		if (max_insts != 0 && insts == max_insts) break;
+
+		size_t budget = tickrate;
+		if (max_insts != 0) budget = MAX(budget, max_insts - insts);
+
+		insts += chip8_run(&chip8, budget);
+		chip8_tick(&chip8);
+		++frames;
+	}
+	double elapsed = now() - start;
+
+	printf("rom:          %s\n", filename);
+	printf("engine:       %s\n", engines[chip8.engine]);
+	printf("seed:         %llu\n", (unsigned long long)(movie_file != NULL ? movie.seed : seed));
+	printf("instructions: %zu\n", insts);
+	printf("frames:       %zu\n", frames);
+	printf("elapsed:      %.6f s\n", elapsed);
+	printf("speed:        %.2f M instructions/s\n", elapsed > 0 ? insts / elapsed / 1e6 : 0);
+	printf("state:        %s\n", chip8.halt ? "halted"
+	                           : chip8.wait_key != -1 ? "waiting for key" : "running");
+
+	for (size_t r = 0; r < 16; r += 8) {
+		printf("v%X-v%X:        ", (unsigned)r, (unsigned)r + 7);
+		for (size_t i = r; i < r + 8; ++i)
+			printf("%02X%c", chip8.vregs[i], i == r + 7 ? '\n' : ' ');
+	}
+	printf("I: %04X  PC: %04X  SC: %04X  DT: %02X  ST: %02X  plane: %u\n",
+		chip8.I, chip8.PC, chip8.SC, chip8.delay_tmr, chip8.sound_tmr, chip8.plane);
+	printf("display:      %016llx (%s)\n",
+		(unsigned long long)fnv1a(chip8.display, sizeof(chip8.display), FNV1A_INIT),
+		chip8.hires ? "hires" : "lores");
+
+	if (movie_file != NULL) {
+		if (status == MOVIE_DIVERGED)
+			printf("movie:        diverged at frame %zu\n", movie.frames);
+		else
+			printf("movie:        %zu frames matched\n", movie.frames);
+		movie_close(&movie);
+	}
+
+#ifdef CHIP8_PROFILER
+	chip8_profile_dump(&chip8, CHIP8_PROFILE_FILE);
+	chip8_profile_fold(&chip8, CHIP8_FOLDED_FILE);
+	chip8_profile_stop(&chip8);
+#endif
+	jit_free(&chip8);
+
+	return status == MOVIE_DIVERGED ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,554 @@
+// A basic-block translator from CHIP-8 to x86-64.
+//
+// Blocks are found by walking chip8_next() from the PC until a branch, a
+// skip, or anything that touches the display, memory, keypad or the
+// interpreter's halt/wait_key state. Straight-line register arithmetic is
+// compiled to host code that works directly on the fields of struct CHIP8
+// (pointer in %rdi); the instruction that ended the block is then executed
+// by chip8_step(), so nothing here has to duplicate the hard opcodes.
+// FX33, FX55 and FX65, which score and save code runs in tight loops, are
+// compiled too so as not to end the block there.
+//
+// Stores into memory (FX55, FX33, 5XY2, chip8_load) all go through
+// chip8_invalidate(), which calls jit_invalidate() to throw away any block
+// whose code was read from the bytes being written. A block that stored
+// over code, its own or any other, returns straight after the store.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "util.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define JIT_ARENA_SIZE  (4 * 1024 * 1024)
+#define JIT_MAX_BLOCKS  16384
+#define JIT_MAX_INSTS   32
+#define JIT_MAX_CODE    (JIT_MAX_INSTS * 128 + 64) // worst case host bytes per block
+#define JIT_MAX_SPAN    (JIT_MAX_INSTS * 4 + 2)    // worst case CHIP-8 bytes per block
+#define JIT_PAGE_SHIFT  8
+
+#define MEMORY_SIZE     SIZEOF(((struct CHIP8 *)0)->memory)
+
+// Offset and size of a field of struct CHIP8, for the emitters below.
+#define FIELD(F)  offsetof(struct CHIP8, F), sizeof(((struct CHIP8 *)0)->F)
+#define VREG(R)   (offsetof(struct CHIP8, vregs) + (R))
+
+_Static_assert(sizeof(((struct CHIP8 *)0)->I) == 2, "FX1E/FX29 emit 16-bit stores to I");
+_Static_assert(sizeof(((struct CHIP8 *)0)->stack[0]) == 2, "2NNN/00EE assume a 16-bit stack");
+
+// Returns the number of instructions it ran.
+typedef uint32_t (*jit_fn_t)(struct CHIP8 *);
+
+struct jit_block {
+	jit_fn_t fn;     // NULL if the first instruction can't be translated
+	size_t   ninst;
+	size_t   end;    // one past the last byte of CHIP-8 memory the block read
+};
+
+struct CHIP8_jit {
+	uint8_t *arena;
+	size_t   arena_used;
+
+	struct jit_block blocks[JIT_MAX_BLOCKS];
+	size_t           nblocks;
+
+	uint16_t index[MEMORY_SIZE];                           // block number + 1, or 0
+	size_t   reach[(MEMORY_SIZE >> JIT_PAGE_SHIFT) + 1];   // furthest end of the blocks starting in a page
+	uint64_t invalidated;                                  // blocks thrown away by stores so far
+};
+
+enum { RAX = 0, RCX = 1, RDX = 2, AH = 4 }; // AH only in byte operations
+
+static inline void
+e8(uint8_t **p, uint8_t byte)
+{
+	*(*p)++ = byte;
+}
+
+static inline void
+e16(uint8_t **p, uint16_t word)
+{
+	memcpy(*p, &word, sizeof(word));
+	*p += sizeof(word);
+}
+
+static inline void
+e32(uint8_t **p, uint32_t dword)
+{
+	memcpy(*p, &dword, sizeof(dword));
+	*p += sizeof(dword);
+}
+
+// ModRM for [rdi + disp32].
+static inline void
+e_rdi(uint8_t **p, uint8_t reg, size_t disp)
+{
+	e8(p, 0x80 | (reg << 3) | 7);
+	e32(p, disp);
+}
+
+// ModRM + SIB for [rdi + index + disp32].
+static inline void
+e_rdi_idx(uint8_t **p, uint8_t reg, uint8_t index, size_t disp)
+{
+	e8(p, 0x84 | (reg << 3));
+	e8(p, (index << 3) | 7);
+	e32(p, disp);
+}
+
+// ModRM + SIB for [rdi + rax*2 + disp32].
+static inline void
+e_rdi_rax2(uint8_t **p, uint8_t reg, size_t disp)
+{
+	e8(p, 0x84 | (reg << 3));
+	e8(p, 0x47);
+	e32(p, disp);
+}
+
+// <opcode> reg8, [rdi + disp] (or the other way around, depending on opcode)
+static inline void
+e_op8(uint8_t **p, uint8_t opcode, uint8_t reg, size_t disp)
+{
+	e8(p, opcode);
+	e_rdi(p, reg, disp);
+}
+
+// Zero-extending load of a field into a 64-bit register.
+static void
+e_load(uint8_t **p, uint8_t reg, size_t off, size_t sz)
+{
+	switch (sz) {
+	break; case 1: e8(p, 0x0F); e8(p, 0xB6);
+	break; case 2: e8(p, 0x0F); e8(p, 0xB7);
+	break; case 4: e8(p, 0x8B);
+	break; case 8: e8(p, 0x48); e8(p, 0x8B);
+	}
+	e_rdi(p, reg, off);
+}
+
+static void
+e_store(uint8_t **p, uint8_t reg, size_t off, size_t sz)
+{
+	switch (sz) {
+	break; case 1: e8(p, 0x88);
+	break; case 2: e8(p, 0x66); e8(p, 0x89);
+	break; case 4: e8(p, 0x89);
+	break; case 8: e8(p, 0x48); e8(p, 0x89);
+	}
+	e_rdi(p, reg, off);
+}
+
+static void
+e_store_imm(uint8_t **p, size_t off, size_t sz, uint32_t imm)
+{
+	switch (sz) {
+	break; case 1: e8(p, 0xC6); e_rdi(p, 0, off); e8(p, imm);
+	break; case 2: e8(p, 0x66); e8(p, 0xC7); e_rdi(p, 0, off); e16(p, imm);
+	break; case 4: e8(p, 0xC7); e_rdi(p, 0, off); e32(p, imm);
+	break; case 8: e8(p, 0x48); e8(p, 0xC7); e_rdi(p, 0, off); e32(p, imm);
+	}
+}
+
+// PC = cond ? taken : not_taken, where `cmov` is the cmovcc opcode byte for
+// `cond` and the flags have already been set.
+static void
+e_select_pc(uint8_t **p, uint8_t cmov, size_t taken, size_t not_taken)
+{
+	e8(p, 0xB8); e32(p, not_taken);           // mov eax, not_taken
+	e8(p, 0xB9); e32(p, taken);               // mov ecx, taken
+	e8(p, 0x0F); e8(p, cmov); e8(p, 0xC1);    // cmovcc eax, ecx
+	e_store(p, RAX, FIELD(PC));
+}
+
+// chip8_invalidate() the `len` bytes a block just stored at I, and tell it
+// whether to return: the store was over some block's code, maybe its own.
+static bool
+jit_stored(struct CHIP8 *chip8, size_t len)
+{
+	uint64_t invalidated = chip8->jit->invalidated;
+	chip8_invalidate(chip8, chip8->I, len);
+	return chip8->jit->invalidated != invalidated;
+}
+
+// Call jit_stored() after the `done`th instruction of the block stored `len`
+// bytes at I, and return from the block with PC at `next` if it says to.
+static void
+e_stored(uint8_t **p, size_t len, size_t next, size_t done)
+{
+	e8(p, 0x57);                              // push rdi
+	e8(p, 0xBE); e32(p, len);                 // mov esi, len
+	e8(p, 0x48); e8(p, 0xB8);                 // mov rax, jit_stored
+	uint64_t fn = (uint64_t)(uintptr_t)jit_stored;
+	memcpy(*p, &fn, sizeof(fn)); *p += sizeof(fn);
+	e8(p, 0xFF); e8(p, 0xD0);                 // call rax
+	e8(p, 0x5F);                              // pop rdi
+	e8(p, 0x84); e8(p, 0xC0);                 // test al, al
+	e8(p, 0x74); uint8_t *skip = (*p)++;      // jz past the return
+	e_store_imm(p, FIELD(PC), next);
+	e8(p, 0xB8); e32(p, done);                // mov eax, done
+	e8(p, 0xC3);                              // ret
+	*skip = *p - (skip + 1);
+}
+
+// Copy V0..VX to (FX55) or from (FX65) memory at I, wrapping around the end
+// of memory like chip8_save() and chip8_restore().
+static void
+e_copy_regs(uint8_t **p, uint8_t X, bool save)
+{
+	size_t vregs = VREG(0), memory = offsetof(struct CHIP8, memory);
+	e_load(p, RAX, FIELD(I));
+	e8(p, 0x31); e8(p, 0xC9);                 // xor ecx, ecx
+	uint8_t *loop = *p;
+	e8(p, 0x25); e32(p, CHIP8_MEM_MASK);      // and eax, CHIP8_MEM_MASK
+	e8(p, 0x0F); e8(p, 0xB6);                 // movzx edx, byte [from]
+	e_rdi_idx(p, RDX, save ? RCX : RAX, save ? vregs : memory);
+	e8(p, 0x88);                              // mov [to], dl
+	e_rdi_idx(p, RDX, save ? RAX : RCX, save ? memory : vregs);
+	e8(p, 0xFF); e8(p, 0xC0);                 // inc eax
+	e8(p, 0xFF); e8(p, 0xC1);                 // inc ecx
+	e8(p, 0x83); e8(p, 0xF9); e8(p, X + 1);   // cmp ecx, X + 1
+	e8(p, 0x72); e8(p, loop - (*p + 1));      // jb loop
+}
+
+// Emit the host code for `inst` (at `where`), the `done`th instruction
+// of its block. Returns false, emitting nothing, if the instruction has to
+// be left to chip8_step(). *ends is set if the instruction writes PC and so
+// must be the last one in the block, and *end is extended to cover any
+// extra memory the translation read.
+static bool
+jit_emit(struct CHIP8 *chip8, uint8_t **p, struct CHIP8_inst *inst,
+		size_t where, size_t done, bool *ends, size_t *end)
+{
+	uint8_t X = inst->X, Y = inst->Y;
+	size_t next = where + inst->op_len;
+
+	switch (inst->type) {
+	break; case I_6XNN:
+		e8(p, 0xC6); e_rdi(p, 0, VREG(X)); e8(p, inst->NN);   // mov byte [VX], NN
+	break; case I_7XNN:
+		e8(p, 0x80); e_rdi(p, 0, VREG(X)); e8(p, inst->NN);   // add byte [VX], NN
+	break; case I_8XY0:
+		e_op8(p, 0x8A, RAX, VREG(Y));                          // mov al, [VY]
+		e_op8(p, 0x88, RAX, VREG(X));                          // mov [VX], al
+	break; case I_8XY1:
+		e_op8(p, 0x8A, RAX, VREG(Y));
+		e_op8(p, 0x08, RAX, VREG(X));                          // or [VX], al
+	break; case I_8XY2:
+		e_op8(p, 0x8A, RAX, VREG(Y));
+		e_op8(p, 0x20, RAX, VREG(X));                          // and [VX], al
+	break; case I_8XY3:
+		e_op8(p, 0x8A, RAX, VREG(Y));
+		e_op8(p, 0x30, RAX, VREG(X));                          // xor [VX], al
+	break; case I_8XY4:
+		// Like the interpreter, VF is only ever set here, never cleared.
+		e_load(p, RAX, VREG(X), 1);
+		e_load(p, RCX, VREG(Y), 1);
+		e8(p, 0x01); e8(p, 0xC8);                              // add eax, ecx
+		e8(p, 0x3D); e32(p, 0xFF);                             // cmp eax, 0xFF
+		e8(p, 0x76); e8(p, 7);                                 // jbe +7
+		e_store_imm(p, VREG(15), 1, 1);                        // mov byte [VF], 1
+		e_op8(p, 0x88, RAX, VREG(X));
+	break; case I_8XY5: case I_8XY7: {
+		uint8_t a = inst->type == I_8XY5 ? X : Y;
+		uint8_t b = inst->type == I_8XY5 ? Y : X;
+		e_op8(p, 0x8A, RAX, VREG(a));
+		e_op8(p, 0x8A, RCX, VREG(b));
+		e8(p, 0x38); e8(p, 0xC8);                              // cmp al, cl
+		e8(p, 0x0F); e8(p, 0x93); e8(p, 0xC2);                 // setae dl
+		e8(p, 0x28); e8(p, 0xC8);                              // sub al, cl
+		e_op8(p, 0x88, RAX, VREG(X));
+		e_op8(p, 0x88, RDX, VREG(15));
+	} break; case I_8X06:
+		e_op8(p, 0x8A, RAX, VREG(X));
+		e8(p, 0x24); e8(p, 0x01);                              // and al, 1
+		e_op8(p, 0x88, RAX, VREG(15));
+		e_op8(p, 0x8A, RAX, VREG(X));                          // (VX may be VF)
+		e8(p, 0xD0); e8(p, 0xE8);                              // shr al, 1
+		e_op8(p, 0x88, RAX, VREG(X));
+	break; case I_8X0E:
+		e_op8(p, 0x8A, RAX, VREG(X));
+		e8(p, 0xC0); e8(p, 0xE8); e8(p, 7);                    // shr al, 7
+		e_op8(p, 0x88, RAX, VREG(15));
+		e_op8(p, 0x8A, RAX, VREG(X));
+		e8(p, 0x00); e8(p, 0xC0);                              // add al, al
+		e_op8(p, 0x88, RAX, VREG(X));
+	break; case I_ANNN:
+		e_store_imm(p, FIELD(I), inst->NNN);
+	break; case I_F000:
+		e_store_imm(p, FIELD(I), inst->NNNN);
+	break; case I_FX01:
+		e_store_imm(p, FIELD(plane), X & 3);
+	break; case I_FX07:
+		e_op8(p, 0x8A, RAX, offsetof(struct CHIP8, delay_tmr));
+		e_op8(p, 0x88, RAX, VREG(X));
+	break; case I_FX15:
+		e_op8(p, 0x8A, RAX, VREG(X));
+		e_op8(p, 0x88, RAX, offsetof(struct CHIP8, delay_tmr));
+	break; case I_FX18:
+		e_op8(p, 0x8A, RAX, VREG(X));
+		e_op8(p, 0x88, RAX, offsetof(struct CHIP8, sound_tmr));
+	break; case I_FX1E:
+		e_load(p, RAX, VREG(X), 1);
+		e8(p, 0x66); e8(p, 0x01); e_rdi(p, RAX, offsetof(struct CHIP8, I)); // add [I], ax
+	break; case I_FX29: case I_FX30:
+		e_load(p, RAX, VREG(X), 1);
+		e8(p, 0x83); e8(p, 0xE0); e8(p, 0x0F);                 // and eax, 0xF
+		e8(p, 0x8D); e8(p, 0x04); e8(p, 0x80);                 // lea eax, [rax + rax*4]
+		if (inst->type == I_FX30) {
+			e8(p, 0x01); e8(p, 0xC0);                      // add eax, eax
+			e8(p, 0x05); e32(p, S_FONT_START);             // add eax, S_FONT_START
+		} else {
+			e8(p, 0x05); e32(p, FONT_START);
+		}
+		e_store(p, RAX, FIELD(I));
+	break; case I_1NNN:
+		e_store_imm(p, FIELD(PC), inst->NNN);
+		*ends = true;
+	break; case I_BNNN:
+		e_load(p, RAX, VREG(0), 1);
+		e8(p, 0x05); e32(p, inst->NNN);                        // add eax, NNN
+		e_store(p, RAX, FIELD(PC));
+		*ends = true;
+	break; case I_2NNN:
+		e_load(p, RAX, FIELD(SC));
+		e8(p, 0x66); e8(p, 0xC7);                              // mov word [stack + SC*2], next
+		e_rdi_rax2(p, 0, offsetof(struct CHIP8, stack));
+		e16(p, next);
+		e8(p, 0x48); e8(p, 0x83); e8(p, 0xC0); e8(p, 0x01);   // add rax, 1
+		e8(p, 0x25); e32(p, CHIP8_STACK_MASK);                 // and eax, CHIP8_STACK_MASK
+		e_store(p, RAX, FIELD(SC));
+		e_store_imm(p, FIELD(PC), inst->NNN);
+		*ends = true;
+	break; case I_00EE:
+		e_load(p, RAX, FIELD(SC));
+		e8(p, 0x48); e8(p, 0x83); e8(p, 0xE8); e8(p, 0x01);   // sub rax, 1
+		e8(p, 0x25); e32(p, CHIP8_STACK_MASK);                 // and eax, CHIP8_STACK_MASK
+		e_store(p, RAX, FIELD(SC));
+		e8(p, 0x0F); e8(p, 0xB7);                              // movzx ecx, word [stack + SC*2]
+		e_rdi_rax2(p, RCX, offsetof(struct CHIP8, stack));
+		e8(p, 0x66); e8(p, 0xC7);                              // mov word [stack + SC*2], 0
+		e_rdi_rax2(p, 0, offsetof(struct CHIP8, stack));
+		e16(p, 0);
+		e_store(p, RCX, FIELD(PC));
+		*ends = true;
+	break; case I_3XNN: case I_4XNN: case I_5XY0: case I_9XY0: {
+		// The length of the skipped instruction is baked in, so the
+		// block also depends on the two bytes after this one.
+		if (next + 2 > MEMORY_SIZE)
+			return false;
+		size_t skip = next + (chip8->memory[next] == 0xF0 && chip8->memory[next + 1] == 0x00 ? 4 : 2);
+
+		if (inst->type == I_3XNN || inst->type == I_4XNN) {
+			e8(p, 0x80); e_rdi(p, 7, VREG(X)); e8(p, inst->NN); // cmp byte [VX], NN
+		} else {
+			e_op8(p, 0x8A, RAX, VREG(X));
+			e_op8(p, 0x3A, RAX, VREG(Y));                       // cmp al, [VY]
+		}
+
+		bool on_equal = inst->type == I_3XNN || inst->type == I_5XY0;
+		e_select_pc(p, on_equal ? 0x44 : 0x45, skip, next);    // cmove/cmovne
+		if (*end < next + 2) *end = next + 2;
+		*ends = true;
+	} break; case I_FX33: {
+		size_t memory = offsetof(struct CHIP8, memory);
+		e_load(p, RAX, VREG(X), 1);
+		e8(p, 0xB1); e8(p, 10);                                // mov cl, 10
+		e8(p, 0xF6); e8(p, 0xF1);                              // div cl
+		e8(p, 0x88); e8(p, 0xE2);                              // mov dl, ah
+		e8(p, 0x0F); e8(p, 0xB6); e8(p, 0xC0);                 // movzx eax, al
+		e8(p, 0xF6); e8(p, 0xF1);                              // div cl
+		e_load(p, RCX, FIELD(I));
+		e8(p, 0x81); e8(p, 0xE1); e32(p, CHIP8_MEM_MASK);      // and ecx, CHIP8_MEM_MASK
+		e8(p, 0x88); e_rdi_idx(p, RAX, RCX, memory);           // mov [memory + rcx], al
+		e8(p, 0xFF); e8(p, 0xC1);                              // inc ecx
+		e8(p, 0x81); e8(p, 0xE1); e32(p, CHIP8_MEM_MASK);      // and ecx, CHIP8_MEM_MASK
+		e8(p, 0x88); e_rdi_idx(p, AH, RCX, memory);            // mov [memory + rcx], ah
+		e8(p, 0xFF); e8(p, 0xC1);                              // inc ecx
+		e8(p, 0x81); e8(p, 0xE1); e32(p, CHIP8_MEM_MASK);      // and ecx, CHIP8_MEM_MASK
+		e8(p, 0x88); e_rdi_idx(p, RDX, RCX, memory);           // mov [memory + rcx], dl
+		e_stored(p, 3, next, done);
+	} break; case I_FX55:
+		e_copy_regs(p, X, true);
+		e_stored(p, X + 1, next, done);
+	break; case I_FX65:
+		e_copy_regs(p, X, false);
+	break; default:
+		return false;
+	break;
+	}
+
+	return true;
+}
+
+static void
+jit_flush(struct CHIP8_jit *jit)
+{
+	jit->arena_used = 0;
+	jit->nblocks = 0;
+	memset(jit->index, 0, sizeof(jit->index));
+	memset(jit->reach, 0, sizeof(jit->reach));
+}
+
+static struct jit_block *
+jit_compile(struct CHIP8 *chip8, struct CHIP8_jit *jit, size_t pc)
+{
+	if (jit->nblocks == JIT_MAX_BLOCKS || jit->arena_used + JIT_MAX_CODE > JIT_ARENA_SIZE)
+		jit_flush(jit);
+
+	uint8_t *start = &jit->arena[jit->arena_used];
+	uint8_t *p = start;
+
+	size_t where = pc;
+	size_t end = pc;
+	size_t ninst = 0;
+	bool ends = false;
+
+	while (!ends && ninst < JIT_MAX_INSTS && where + 4 <= MEMORY_SIZE) {
+		struct CHIP8_inst inst = chip8_next(chip8, where);
+		size_t inst_end = where + inst.op_len;
+		if (!jit_emit(chip8, &p, &inst, where, ninst + 1, &ends, &inst_end))
+			break;
+		end = inst_end;
+		where += inst.op_len;
+		++ninst;
+	}
+
+	if (!ends) {
+		// Fell through into something we couldn't translate.
+		e_store_imm(&p, FIELD(PC), where);
+	}
+	e8(&p, 0xB8); e32(&p, ninst); // mov eax, ninst
+	e8(&p, 0xC3);                 // ret
+
+	struct jit_block *block = &jit->blocks[jit->nblocks++];
+	block->ninst = ninst;
+	block->end = end > pc + 2 ? end : pc + 2;
+	block->fn = NULL;
+
+	if (ninst > 0) {
+		block->fn = (jit_fn_t)(uintptr_t)start;
+		jit->arena_used += p - start;
+	}
+
+	jit->index[pc] = jit->nblocks;
+	if (jit->reach[pc >> JIT_PAGE_SHIFT] < block->end)
+		jit->reach[pc >> JIT_PAGE_SHIFT] = block->end;
+
+	return block;
+}
+
+static struct CHIP8_jit *
+jit_state(struct CHIP8 *chip8)
+{
+	if (chip8->jit != NULL)
+		return chip8->jit;
+
+	struct CHIP8_jit *jit = ecalloc(1, sizeof(struct CHIP8_jit));
+	jit->arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->arena == MAP_FAILED) {
+		log("%s", "Could not map executable memory, JIT disabled");
+		jit->arena = NULL;
+	}
+
+	chip8->jit = jit;
+	return jit;
+}
+
+size_t
+jit_run(struct CHIP8 *chip8, size_t count)
+{
+	struct CHIP8_jit *jit = jit_state(chip8);
+	size_t executed = 0;
+
+	while (executed < count && !chip8->halt && chip8->wait_key == -1) {
+		struct jit_block *block = NULL;
+
+		if (jit->arena != NULL && (size_t)chip8->PC + 4 <= MEMORY_SIZE) {
+			size_t i = jit->index[chip8->PC];
+			block = i != 0 ? &jit->blocks[i - 1] : jit_compile(chip8, jit, chip8->PC);
+		}
+
+		if (block != NULL && block->fn != NULL && block->ninst <= count - executed) {
+			executed += (block->fn)(chip8);
+		} else {
+			chip8_step(chip8);
+			executed += 1;
+		}
+	}
+
+	return executed;
+}
+
+void
+jit_invalidate(struct CHIP8 *chip8, size_t addr, size_t len)
+{
+	struct CHIP8_jit *jit = chip8->jit;
+	if (jit == NULL || jit->arena == NULL || len == 0)
+		return;
+
+	size_t lo = addr > JIT_MAX_SPAN ? addr - JIT_MAX_SPAN : 0;
+	size_t hi = MAX(addr + len, MEMORY_SIZE);
+
+	// Only blocks starting in [lo, hi) can cover addr, and only those
+	// that reach past it do. Data stored to just after the code, like
+	// FX33's digits, usually rules out every page here.
+	bool any = false;
+	for (size_t pg = lo >> JIT_PAGE_SHIFT; pg <= (hi - 1) >> JIT_PAGE_SHIFT; ++pg)
+		any |= jit->reach[pg] > addr;
+	if (!any) return;
+
+	for (size_t s = lo; s < hi; ++s) {
+		if (jit->index[s] != 0 && jit->blocks[jit->index[s] - 1].end > addr) {
+			jit->index[s] = 0;
+			jit->invalidated += 1;
+		}
+	}
+}
+
+void
+jit_free(struct CHIP8 *chip8)
+{
+	struct CHIP8_jit *jit = chip8->jit;
+	if (jit == NULL) return;
+
+	if (jit->arena != NULL)
+		munmap(jit->arena, JIT_ARENA_SIZE);
+	free(jit);
+	chip8->jit = NULL;
+}
+
+#else
+
+size_t
+jit_run(struct CHIP8 *chip8, size_t count)
+{
+	size_t executed = 0;
+	for (; executed < count && !chip8->halt && chip8->wait_key == -1; ++executed)
+		chip8_step(chip8);
+	return executed;
+}
+
+void
+jit_invalidate(struct CHIP8 *chip8, size_t addr, size_t len)
+{
+	UNUSED(chip8);
+	UNUSED(addr);
+	UNUSED(len);
+}
+
+void
+jit_free(struct CHIP8 *chip8)
+{
+	UNUSED(chip8);
+}
+
+#endif
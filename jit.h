@@ -0,0 +1,12 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+
+#include "chip8.h"
+
+size_t jit_run(struct CHIP8 *chip8, size_t count);
+void jit_invalidate(struct CHIP8 *chip8, size_t addr, size_t len);
+void jit_free(struct CHIP8 *chip8);
+
+#endif
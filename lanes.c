@@ -0,0 +1,343 @@
+// Runs a group of machines in lockstep, for evaluating one ROM under many
+// seeds or inputs at once.
+//
+// While running, every lane's registers, timers and stack live in a
+// structure-of-arrays register file, one array per register with one entry
+// per lane. Each dispatch picks the lane with the lowest PC among those
+// that still have instructions left, and every lane at that PC with the
+// same opcode executes it together: the ALU, skip, jump, call and timer
+// instructions are a single loop over all LANES_MAX entries of the register
+// file, with masked-off lanes left unchanged, which the compiler can turn
+// into SIMD. Lanes that diverge are masked off until the lowest-PC lanes
+// catch up with them again, which for loops with a shared body is usually
+// right away.
+//
+// Everything else (drawing, memory, keypad, the XO-CHIP extensions) copies
+// the lane's registers into its struct CHIP8, runs chip8_step() on it, and
+// copies them back, so this file only duplicates the easy opcodes.
+//
+// Every lane runs exactly `count` instructions per lanes_run() unless it
+// halts or waits for a key first, so the results are the same as running
+// each machine with chip8_run() on its own.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "lanes.h"
+#include "util.h"
+
+// Assign `expr` to dst[l] for every lane in `mask`. The loop always covers
+// all LANES_MAX lanes so that it has a fixed trip count and no branches.
+#define LANES_SET(dst, expr) \
+	for (size_t l = 0; l < LANES_MAX; ++l) \
+		(dst)[l] = mask[l] ? (expr) : (dst)[l]
+
+void
+lanes_init(struct lanes *lanes, size_t n)
+{
+	ENSURE(n > 0 && n <= LANES_MAX);
+
+	memset(lanes, 0, sizeof(*lanes));
+	lanes->n = n;
+	lanes->m = ecalloc_aligned(_Alignof(struct CHIP8), n, sizeof(struct CHIP8));
+
+	for (size_t l = 0; l < n; ++l)
+		chip8_init(&lanes->m[l]);
+}
+
+void
+lanes_free(struct lanes *lanes)
+{
+	for (size_t l = 0; l < lanes->n; ++l)
+		jit_free(&lanes->m[l]);
+	free(lanes->m);
+}
+
+void
+lanes_load(struct lanes *lanes, char *data, size_t sz)
+{
+	for (size_t l = 0; l < lanes->n; ++l)
+		chip8_load(&lanes->m[l], data, sz);
+	memset(lanes->written, 0, sizeof(lanes->written));
+}
+
+void
+lanes_tick(struct lanes *lanes)
+{
+	for (size_t l = 0; l < lanes->n; ++l)
+		chip8_tick(&lanes->m[l]);
+}
+
+// Copy lane `l`'s registers from its machine into the register file. The
+// stack is left alone: none of the instructions that go through
+// chip8_step() use it.
+static void
+lanes_gather(struct lanes *lanes, size_t l)
+{
+	struct CHIP8 *chip8 = &lanes->m[l];
+
+	for (size_t r = 0; r < 16; ++r)
+		lanes->v[r][l] = chip8->vregs[r];
+	lanes->I[l] = chip8->I;
+	lanes->PC[l] = chip8->PC;
+	lanes->SC[l] = chip8->SC;
+	lanes->delay_tmr[l] = chip8->delay_tmr;
+	lanes->sound_tmr[l] = chip8->sound_tmr;
+}
+
+// The reverse of lanes_gather().
+static void
+lanes_scatter(struct lanes *lanes, size_t l)
+{
+	struct CHIP8 *chip8 = &lanes->m[l];
+
+	for (size_t r = 0; r < 16; ++r)
+		chip8->vregs[r] = lanes->v[r][l];
+	chip8->I = lanes->I[l];
+	chip8->PC = lanes->PC[l];
+	chip8->SC = lanes->SC[l];
+	chip8->delay_tmr = lanes->delay_tmr[l];
+	chip8->sound_tmr = lanes->sound_tmr[l];
+}
+
+// Whether [addr, addr+len) still holds the same bytes in every lane.
+static inline bool
+lanes_shared(struct lanes *lanes, size_t addr, size_t len)
+{
+	return !lanes->written[(addr & CHIP8_MEM_MASK) >> LANES_PAGE_SHIFT]
+	    && !lanes->written[((addr + len - 1) & CHIP8_MEM_MASK) >> LANES_PAGE_SHIFT];
+}
+
+// Length of the instruction at `where` in lane `l`, for skips.
+static inline uint16_t
+lanes_op_len(struct lanes *lanes, size_t l, size_t where)
+{
+	uint8_t *memory = lanes->m[l].memory;
+	return memory[where & CHIP8_MEM_MASK] == 0xF0
+	    && memory[(where + 1) & CHIP8_MEM_MASK] == 0x00 ? 4 : 2;
+}
+
+// Execute `inst` (at `pc`) on every lane in `mask`. Lanes that halt or
+// start waiting for a key have `left` set to 1, so that they stop after
+// this instruction.
+static void
+lanes_exec(struct lanes *lanes, uint8_t *mask, size_t *left, size_t pc,
+		struct CHIP8_inst *inst, size_t lead)
+{
+	uint8_t X = inst->X, Y = inst->Y, NN = inst->NN;
+	uint16_t NNN = inst->NNN;
+	uint8_t *VX = lanes->v[X], *VY = lanes->v[Y], *VF = lanes->v[15];
+	uint16_t next = pc + 2;
+
+	// Skips only need to look at each lane's own memory if it may differ.
+	bool skip_shared = lanes_shared(lanes, next, 2);
+	uint16_t skip = lanes_op_len(lanes, lead, next);
+#define LANES_SKIP(cond) \
+	if (skip_shared) { \
+		LANES_SET(lanes->PC, next + ((cond) ? skip : 0)); \
+	} else { \
+		for (size_t l = 0; l < lanes->n; ++l) \
+			if (mask[l]) lanes->PC[l] = next + ((cond) ? lanes_op_len(lanes, l, next) : 0); \
+	}
+
+	switch (inst->type) {
+	break; case I_00EE:
+		for (size_t l = 0; l < lanes->n; ++l) {
+			if (!mask[l]) continue;
+			uint16_t sc = lanes->SC[l] = (lanes->SC[l] - 1) & CHIP8_STACK_MASK;
+			lanes->PC[l] = lanes->stack[sc][l];
+			lanes->stack[sc][l] = 0;
+		}
+	break; case I_1NNN:
+		LANES_SET(lanes->PC, NNN);
+	break; case I_2NNN:
+		for (size_t l = 0; l < lanes->n; ++l) {
+			if (!mask[l]) continue;
+			lanes->stack[lanes->SC[l]][l] = next;
+			lanes->SC[l] = (lanes->SC[l] + 1) & CHIP8_STACK_MASK;
+		}
+		LANES_SET(lanes->PC, NNN);
+	break; case I_3XNN:
+		LANES_SKIP(VX[l] == NN);
+	break; case I_4XNN:
+		LANES_SKIP(VX[l] != NN);
+	break; case I_5XY0:
+		LANES_SKIP(VX[l] == VY[l]);
+	break; case I_9XY0:
+		LANES_SKIP(VX[l] != VY[l]);
+	break; case I_6XNN:
+		LANES_SET(VX, NN);
+		LANES_SET(lanes->PC, next);
+	break; case I_7XNN:
+		LANES_SET(VX, (uint8_t)(VX[l] + NN));
+		LANES_SET(lanes->PC, next);
+	break; case I_8XY0:
+		LANES_SET(VX, VY[l]);
+		LANES_SET(lanes->PC, next);
+	break; case I_8XY1:
+		LANES_SET(VX, VX[l] | VY[l]);
+		LANES_SET(lanes->PC, next);
+	break; case I_8XY2:
+		LANES_SET(VX, VX[l] & VY[l]);
+		LANES_SET(lanes->PC, next);
+	break; case I_8XY3:
+		LANES_SET(VX, VX[l] ^ VY[l]);
+		LANES_SET(lanes->PC, next);
+	break; case I_8XY4:
+		// Same order of updates as chip8_step(), for when X or Y is F.
+		for (size_t l = 0; l < LANES_MAX; ++l) {
+			uint16_t result = VX[l] + VY[l];
+			VF[l] = mask[l] && result > 255 ? 1 : VF[l];
+			VX[l] = mask[l] ? (uint8_t)result : VX[l];
+		}
+		LANES_SET(lanes->PC, next);
+	break; case I_8XY5:
+		for (size_t l = 0; l < LANES_MAX; ++l) {
+			uint8_t set_vf = VX[l] >= VY[l];
+			VX[l] = mask[l] ? (uint8_t)(VX[l] - VY[l]) : VX[l];
+			VF[l] = mask[l] ? set_vf : VF[l];
+		}
+		LANES_SET(lanes->PC, next);
+	break; case I_8X06:
+		for (size_t l = 0; l < LANES_MAX; ++l) {
+			VF[l] = mask[l] ? VX[l] & 1 : VF[l];
+			VX[l] = mask[l] ? VX[l] >> 1 : VX[l];
+		}
+		LANES_SET(lanes->PC, next);
+	break; case I_8XY7:
+		for (size_t l = 0; l < LANES_MAX; ++l) {
+			uint8_t set_vf = VY[l] >= VX[l];
+			VX[l] = mask[l] ? (uint8_t)(VY[l] - VX[l]) : VX[l];
+			VF[l] = mask[l] ? set_vf : VF[l];
+		}
+		LANES_SET(lanes->PC, next);
+	break; case I_8X0E:
+		for (size_t l = 0; l < LANES_MAX; ++l) {
+			VF[l] = mask[l] ? (VX[l] & 0x80) != 0 : VF[l];
+			VX[l] = mask[l] ? (uint8_t)(VX[l] << 1) : VX[l];
+		}
+		LANES_SET(lanes->PC, next);
+	break; case I_ANNN:
+		LANES_SET(lanes->I, NNN);
+		LANES_SET(lanes->PC, next);
+	break; case I_BNNN:
+		LANES_SET(lanes->PC, NNN + lanes->v[0][l]);
+	break; case I_CXNN:
+		for (size_t l = 0; l < lanes->n; ++l)
+			if (mask[l]) VX[l] = chip8_random(&lanes->m[l]) & NN;
+		LANES_SET(lanes->PC, next);
+	break; case I_FX07:
+		LANES_SET(VX, lanes->delay_tmr[l]);
+		LANES_SET(lanes->PC, next);
+	break; case I_FX15:
+		LANES_SET(lanes->delay_tmr, VX[l]);
+		LANES_SET(lanes->PC, next);
+	break; case I_FX18:
+		LANES_SET(lanes->sound_tmr, VX[l]);
+		LANES_SET(lanes->PC, next);
+	break; case I_FX1E:
+		LANES_SET(lanes->I, lanes->I[l] + VX[l]);
+		LANES_SET(lanes->PC, next);
+	break; case I_FX29:
+		LANES_SET(lanes->I, FONT_START + (VX[l] & 0xF) * 5);
+		LANES_SET(lanes->PC, next);
+	break; case I_FX30:
+		LANES_SET(lanes->I, S_FONT_START + (VX[l] & 0xF) * 10);
+		LANES_SET(lanes->PC, next);
+	break; default:
+		for (size_t l = 0; l < lanes->n; ++l) {
+			if (!mask[l]) continue;
+			struct CHIP8 *chip8 = &lanes->m[l];
+
+			// None of FX33, FX55 and 5XY2 store more than 16 bytes.
+			if (inst->type == I_FX33 || inst->type == I_FX55 || inst->type == I_5XY2) {
+				lanes->written[(lanes->I[l] & CHIP8_MEM_MASK) >> LANES_PAGE_SHIFT] = true;
+				lanes->written[((lanes->I[l] + 15) & CHIP8_MEM_MASK) >> LANES_PAGE_SHIFT] = true;
+			}
+
+			lanes_scatter(lanes, l);
+			chip8_step(chip8);
+			lanes_gather(lanes, l);
+
+			if (chip8->halt || chip8->wait_key != -1)
+				left[l] = 1; // the instruction that stopped it
+		}
+	break;
+	}
+#undef LANES_SKIP
+}
+
+size_t
+lanes_run(struct lanes *lanes, size_t count)
+{
+	size_t n = lanes->n;
+	size_t left[LANES_MAX] = {0};
+	uint8_t mask[LANES_MAX] = {0};
+	size_t executed = 0;
+
+	for (size_t l = 0; l < n; ++l) {
+		struct CHIP8 *chip8 = &lanes->m[l];
+		lanes_gather(lanes, l);
+		for (size_t s = 0; s < CHIP8_STACK_SIZE; ++s)
+			lanes->stack[s][l] = chip8->stack[s];
+		lanes->executed[l] = 0;
+		left[l] = chip8->halt || chip8->wait_key != -1 ? 0 : count;
+	}
+
+	for (;;) {
+		uint32_t pc = UINT32_MAX;
+		for (size_t l = 0; l < LANES_MAX; ++l) {
+			uint32_t key = left[l] > 0 ? lanes->PC[l] : UINT32_MAX;
+			pc = key < pc ? key : pc;
+		}
+		if (pc == UINT32_MAX) break;
+
+		size_t group = 0;
+		for (size_t l = 0; l < LANES_MAX; ++l) {
+			mask[l] = (left[l] > 0) & (lanes->PC[l] == pc);
+			group += mask[l];
+		}
+
+		size_t lead = 0;
+		while (!mask[lead]) ++lead;
+		struct CHIP8_inst inst = chip8_next(&lanes->m[lead], pc);
+
+		// Lanes at the same PC can still differ in the code there, if
+		// some of them have written to it.
+		if (!lanes_shared(lanes, pc, 2)) {
+			for (size_t l = 0; l < n; ++l) {
+				uint8_t *memory = lanes->m[l].memory;
+				if (mask[l] && (memory[pc & CHIP8_MEM_MASK] != (inst.op >> 8)
+						|| memory[(pc + 1) & CHIP8_MEM_MASK] != (inst.op & 0xFF))) {
+					mask[l] = false;
+					group -= 1;
+				}
+			}
+		}
+
+		lanes_exec(lanes, mask, left, pc, &inst, lead);
+
+		for (size_t l = 0; l < LANES_MAX; ++l) {
+			left[l] -= mask[l];
+			lanes->executed[l] += mask[l];
+		}
+
+		executed += group;
+		lanes->steps += group;
+		lanes->dispatches += 1;
+	}
+
+	for (size_t l = 0; l < n; ++l) {
+		lanes_scatter(lanes, l);
+		for (size_t s = 0; s < CHIP8_STACK_SIZE; ++s)
+			lanes->m[l].stack[s] = lanes->stack[s][l];
+	}
+
+	return executed;
+}
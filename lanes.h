@@ -0,0 +1,53 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define LANES_MAX        32
+#define LANES_PAGE_SHIFT 8
+#define LANES_PAGES      (CHIP8_MEM_SIZE >> LANES_PAGE_SHIFT)
+
+// A group of up to LANES_MAX machines run in lockstep (see lanes.c).
+//
+// Between calls to lanes_run() the machines in `m` hold the whole state of
+// each lane and can be inspected or modified like any other struct CHIP8;
+// the register file below is only a working copy used while running. All
+// lanes are assumed to hold the same program, as loaded by lanes_load().
+struct lanes {
+	size_t        n;
+	struct CHIP8 *m;
+
+	// Instructions each lane executed in the last lanes_run().
+	size_t executed[LANES_MAX];
+
+	// Instructions executed and dispatches made over all lanes_run()
+	// calls. steps / dispatches is the average number of lanes that
+	// shared each instruction.
+	size_t steps;
+	size_t dispatches;
+
+	// Structure-of-arrays register file, [register][lane].
+	uint8_t   v[16][LANES_MAX];
+	uint16_t  I[LANES_MAX];
+	uint16_t  PC[LANES_MAX];
+	uint16_t  SC[LANES_MAX];
+	uint8_t   delay_tmr[LANES_MAX];
+	uint8_t   sound_tmr[LANES_MAX];
+	uint16_t  stack[CHIP8_STACK_SIZE][LANES_MAX];
+
+	// Pages of memory that some lane has stored to since lanes_load(),
+	// and that so may differ between lanes.
+	bool written[LANES_PAGES];
+};
+
+void lanes_init(struct lanes *lanes, size_t n);
+void lanes_free(struct lanes *lanes);
+void lanes_load(struct lanes *lanes, char *data, size_t sz);
+void lanes_tick(struct lanes *lanes);
+size_t lanes_run(struct lanes *lanes, size_t count);
+
+#endif
@@ -0,0 +1,216 @@
+// Recording and deterministic replay of sessions.
+//
+// A session is reproducible if the machine starts from the same ROM and
+// chip8_seed(), and sees the same keypad on every frame. A movie file holds
+// exactly that, little-endian:
+//
+//    0   4  "CH8M"
+//    4   2  version
+//    6   2  reserved, 0
+//    8   4  instructions per frame
+//    12  4  reserved, 0
+//    16  8  seed given to chip8_seed()
+//    24  8  fnv1a() of the ROM
+//    32     frames, 10 bytes each:
+//             2  keypad, bit N set if key N is held
+//             8  movie_hash() of the machine at the end of the frame
+//
+// There's no frame count: a recording that was cut short by a crash plays
+// back up to its last whole frame.
+//
+// A frame is the same everywhere: chip8_keypad() with the keypad, tickrate
+// instructions (chip8_run() or chip8_step() in a loop, on any engine), then
+// chip8_tick(). Frontends that record have to run their frames that way,
+// and can't pause or single-step in the middle of one.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "movie.h"
+#include "util.h"
+
+#define MOVIE_HEADER 32
+#define MOVIE_FRAME  10
+
+static void
+put_le(uint8_t *out, uint64_t v, size_t len)
+{
+	for (size_t i = 0; i < len; ++i, v >>= 8)
+		out[i] = v & 0xFF;
+}
+
+static uint64_t
+get_le(const uint8_t *in, size_t len)
+{
+	uint64_t v = 0;
+	for (size_t i = len; i > 0; --i)
+		v = (v << 8) | in[i - 1];
+	return v;
+}
+
+// Hash whole 32-byte blocks as four interleaved streams of words, so that
+// the multiplies of a 64 KiB memory don't wait on each other.
+static uint64_t
+hash_blocks(const void *data, size_t len, uint64_t hash)
+{
+	const uint8_t *bytes = data;
+	uint64_t h[4] = { hash, ~hash, hash ^ 0x5555555555555555, hash ^ 0xAAAAAAAAAAAAAAAA };
+
+	for (size_t i = 0; i + 32 <= len; i += 32) {
+		for (size_t j = 0; j < 4; ++j) {
+			uint64_t w;
+			memcpy(&w, &bytes[i + j * 8], sizeof(w));
+			h[j] = (h[j] ^ w) * 0x100000001b3;
+		}
+	}
+
+	return fnv1a(h, sizeof(h), hash);
+}
+
+// A hash of everything that decides how the machine goes on from here:
+// registers, stack, display and memory, but not the JIT's blocks, the
+// engine or anything else that only changes how fast it gets there.
+//
+// Words are hashed in host byte order, so hashes only match between
+// hosts of the same endianness.
+uint64_t
+movie_hash(struct CHIP8 *chip8)
+{
+	uint8_t regs[16 + 16 + 6 + 6 + 8];
+	uint8_t *r = regs;
+
+	memcpy(r, chip8->vregs, 16); r += 16;
+	memcpy(r, chip8->fregs, 16); r += 16;
+	put_le(r, chip8->PC, 2);     r += 2;
+	put_le(r, chip8->I, 2);      r += 2;
+	put_le(r, chip8->SC, 2);     r += 2;
+	*r++ = chip8->delay_tmr;
+	*r++ = chip8->sound_tmr;
+	*r++ = chip8->plane;
+	*r++ = chip8->hires;
+	*r++ = chip8->wait_key;
+	*r++ = chip8->halt;
+	put_le(r, chip8->rng, 8);    r += 8;
+
+	uint64_t hash = fnv1a(regs, sizeof(regs), FNV1A_INIT);
+	hash = fnv1a(chip8->stack, sizeof(chip8->stack), hash);
+	hash = hash_blocks(chip8->display, sizeof(chip8->display), hash);
+	return hash_blocks(chip8->memory, sizeof(chip8->memory), hash);
+}
+
+// Start recording a session of a machine that has just been seeded with
+// `seed` and loaded with the ROM that hashes to rom_hash.
+bool
+movie_record(struct movie *movie, const char *path, uint64_t seed,
+		uint64_t rom_hash, uint32_t tickrate)
+{
+	memset(movie, 0, sizeof(*movie));
+	movie->tickrate = tickrate;
+	movie->seed = seed;
+	movie->rom_hash = rom_hash;
+
+	if ((movie->fp = fopen(path, "wb")) == NULL)
+		return false;
+
+	uint8_t header[MOVIE_HEADER] = {0};
+	memcpy(header, MOVIE_MAGIC, 4);
+	put_le(&header[4], MOVIE_VERSION, 2);
+	put_le(&header[8], movie->tickrate, 4);
+	put_le(&header[16], movie->seed, 8);
+	put_le(&header[24], movie->rom_hash, 8);
+
+	if (fwrite(header, sizeof(header), 1, movie->fp) != 1) {
+		movie_close(movie);
+		return false;
+	}
+	return true;
+}
+
+// Record a frame that just ran with `keys` held.
+void
+movie_frame(struct movie *movie, struct CHIP8 *chip8, uint16_t keys)
+{
+	uint8_t frame[MOVIE_FRAME];
+	put_le(&frame[0], keys, 2);
+	put_le(&frame[2], movie_hash(chip8), 8);
+
+	if (fwrite(frame, sizeof(frame), 1, movie->fp) != 1)
+		die("Could not write movie frame %zu:", movie->frames);
+
+	movie->frames += 1;
+	movie->keys = keys;
+}
+
+bool
+movie_open(struct movie *movie, const char *path)
+{
+	memset(movie, 0, sizeof(*movie));
+
+	if ((movie->fp = fopen(path, "rb")) == NULL)
+		return false;
+
+	uint8_t header[MOVIE_HEADER];
+	if (fread(header, sizeof(header), 1, movie->fp) != 1
+			|| memcmp(header, MOVIE_MAGIC, 4) != 0
+			|| get_le(&header[4], 2) != MOVIE_VERSION) {
+		movie_close(movie);
+		return false;
+	}
+
+	movie->tickrate = get_le(&header[8], 4);
+	movie->seed = get_le(&header[16], 8);
+	movie->rom_hash = get_le(&header[24], 8);
+	return movie->tickrate != 0;
+}
+
+bool
+movie_next(struct movie *movie, uint16_t *keys, uint64_t *hash)
+{
+	uint8_t frame[MOVIE_FRAME];
+	if (fread(frame, sizeof(frame), 1, movie->fp) != 1)
+		return false;
+
+	*keys = get_le(&frame[0], 2);
+	*hash = get_le(&frame[2], 8);
+	movie->frames += 1;
+	return true;
+}
+
+void
+movie_close(struct movie *movie)
+{
+	if (movie->fp != NULL)
+		fclose(movie->fp);
+	movie->fp = NULL;
+}
+
+// Play an opened movie on chip8, which should have just been loaded with
+// its ROM, until the end or the first frame that comes out different. In
+// the latter case movie->frames is the number of that frame, counting
+// from 1.
+enum movie_status
+movie_replay(struct movie *movie, struct CHIP8 *chip8)
+{
+	uint16_t keys;
+	uint64_t hash;
+
+	chip8_seed(chip8, movie->seed);
+	chip8_keypad(chip8, 0);
+
+	while (movie_next(movie, &keys, &hash)) {
+		chip8_keypad(chip8, keys);
+		movie->keys = keys;
+
+		movie->cycles += chip8_run(chip8, movie->tickrate);
+		chip8_tick(chip8);
+
+		if (movie_hash(chip8) != hash)
+			return MOVIE_DIVERGED;
+	}
+
+	return MOVIE_END;
+}
@@ -0,0 +1,41 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+#define MOVIE_MAGIC   "CH8M"
+#define MOVIE_VERSION 2
+
+// A recorded session: everything needed to play a ROM again exactly as it
+// was played, one frame at a time (see movie.c for the file format).
+struct movie {
+	FILE     *fp;
+	uint32_t  tickrate; // instructions per frame
+	uint64_t  seed;     // given to chip8_seed() before the first frame
+	uint64_t  rom_hash; // fnv1a() of the ROM
+	size_t    frames;   // frames written or read so far
+	uint16_t  keys;     // keypad of the last frame written or read
+	size_t    cycles;   // instructions run by movie_replay()
+};
+
+enum movie_status {
+	MOVIE_END,      // every frame matched
+	MOVIE_DIVERGED, // a frame's state hash didn't match
+};
+
+bool movie_record(struct movie *movie, const char *path, uint64_t seed,
+		uint64_t rom_hash, uint32_t tickrate);
+void movie_frame(struct movie *movie, struct CHIP8 *chip8, uint16_t keys);
+bool movie_open(struct movie *movie, const char *path);
+bool movie_next(struct movie *movie, uint16_t *keys, uint64_t *hash);
+void movie_close(struct movie *movie);
+
+uint64_t movie_hash(struct CHIP8 *chip8);
+enum movie_status movie_replay(struct movie *movie, struct CHIP8 *chip8);
+
+#endif
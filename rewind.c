@@ -0,0 +1,253 @@
+// A rolling history of machine states, for stepping a running game back
+// frame by frame.
+//
+// The state of a frame is everything in struct CHIP8 before `snap` plus
+// memory (about 130 KiB on XO-CHIP), but from one frame to the next very
+// little of it changes. Every `interval` frames a keyframe is stored; every
+// other frame is stored as its XOR against the keyframe before it, which
+// is mostly zeroes. Both are then run-length encoded as a sequence of
+//
+//    <zeroes> <n> <n literal bytes>
+//
+// with the counts as LEB128 varints, so that a keyframe of a mostly empty
+// 64 KiB memory and a delta that only touched a few registers and display
+// rows each come to a few hundred bytes.
+//
+// Stepping back decodes the newest remaining frame's keyframe and applies
+// its delta, so it costs two passes over the state no matter how far back
+// the frame is.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "rewind.h"
+#include "util.h"
+
+#define REWIND_REGS  offsetof(struct CHIP8, snap)
+#define REWIND_STATE (REWIND_REGS + CHIP8_MEM_SIZE)
+
+// Worst case for rle_encode(): a literal run ends only at two zeroes, so
+// there are at most REWIND_STATE / 3 + 1 runs of at most two 3-byte counts.
+#define REWIND_ENCODED_MAX (REWIND_STATE * 3 + 16)
+
+static inline struct rewind_frame *
+rewind_frame(struct rewind_buffer *rw, size_t i)
+{
+	return &rw->frames[(rw->tail + i) % rw->cap];
+}
+
+static uint8_t *
+put_varint(uint8_t *out, size_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*out++ = (v & 0x7F) | 0x80;
+	*out++ = v;
+	return out;
+}
+
+static const uint8_t *
+get_varint(const uint8_t *in, size_t *v)
+{
+	*v = 0;
+	for (size_t shift = 0; ; shift += 7) {
+		*v |= (size_t)(*in & 0x7F) << shift;
+		if (!(*in++ & 0x80))
+			return in;
+	}
+}
+
+static size_t
+rle_encode(const uint8_t *in, size_t n, uint8_t *out)
+{
+	uint8_t *o = out;
+
+	for (size_t i = 0; i < n;) {
+		size_t start = i;
+		for (uint64_t w; i + 8 <= n && (memcpy(&w, &in[i], 8), w == 0);)
+			i += 8;
+		while (i < n && in[i] == 0)
+			++i;
+		size_t zeroes = i - start;
+
+		start = i;
+		while (i < n && (in[i] != 0 || (i + 1 < n && in[i + 1] != 0)))
+			++i;
+
+		o = put_varint(o, zeroes);
+		o = put_varint(o, i - start);
+		memcpy(o, &in[start], i - start);
+		o += i - start;
+	}
+
+	return o - out;
+}
+
+// Decode `in` into `out`, or if `xor` is set, XOR it into `out` instead.
+static void
+rle_decode(const uint8_t *in, size_t len, uint8_t *out, bool xor)
+{
+	const uint8_t *end = in + len;
+
+	while (in < end) {
+		size_t zeroes, n;
+		in = get_varint(in, &zeroes);
+		in = get_varint(in, &n);
+
+		if (!xor)
+			memset(out, 0, zeroes);
+		out += zeroes;
+
+		if (xor) {
+			for (size_t i = 0; i < n; ++i)
+				out[i] ^= in[i];
+		} else {
+			memcpy(out, in, n);
+		}
+		out += n;
+		in += n;
+	}
+}
+
+static void
+rewind_save(struct CHIP8 *chip8, uint8_t *state)
+{
+	memcpy(state, chip8, REWIND_REGS);
+	memcpy(&state[REWIND_REGS], chip8->memory, CHIP8_MEM_SIZE);
+}
+
+static void
+rewind_load(struct CHIP8 *chip8, const uint8_t *state)
+{
+	const uint8_t *memory = &state[REWIND_REGS];
+
+	// Only invalidate what actually changed, so that the JIT's blocks
+	// for the rest of memory survive.
+	for (size_t pg = 0; pg < CHIP8_PAGES; ++pg) {
+		size_t addr = pg << CHIP8_PAGE_SHIFT;
+		if (memcmp(&chip8->memory[addr], &memory[addr], CHIP8_PAGE_SIZE) == 0)
+			continue;
+
+		memcpy(&chip8->memory[addr], &memory[addr], CHIP8_PAGE_SIZE);
+		chip8_invalidate(chip8, addr, CHIP8_PAGE_SIZE);
+	}
+
+	// The JIT may have been set up after the frame was saved, and the
+	// keys held are the ones held now.
+	uint16_t keypad = chip8->keypad;
+	enum CHIP8_engine engine = chip8->engine;
+	struct CHIP8_jit *jit = chip8->jit;
+
+	memcpy(chip8, state, REWIND_REGS);
+
+	chip8->keypad = keypad;
+	chip8->engine = engine;
+	chip8->jit = jit;
+	chip8->dirty_rows = UINT64_MAX;
+}
+
+static void
+rewind_drop(struct rewind_buffer *rw, struct rewind_frame *frame)
+{
+	rw->bytes -= frame->len;
+	free(frame->data);
+	frame->data = NULL;
+	frame->len = 0;
+}
+
+void
+rewind_init(struct rewind_buffer *rw, size_t frames, size_t interval)
+{
+	ENSURE(interval > 0);
+	ENSURE(frames > interval);
+
+	memset(rw, 0, sizeof(*rw));
+	rw->cap = frames;
+	rw->interval = interval;
+	rw->frames = ecalloc(frames, sizeof(struct rewind_frame));
+	rw->key = ecalloc(REWIND_STATE, 1);
+	rw->state = ecalloc(REWIND_STATE, 1);
+	rw->scratch = ecalloc(REWIND_ENCODED_MAX, 1);
+}
+
+void
+rewind_free(struct rewind_buffer *rw)
+{
+	for (size_t i = 0; i < rw->len; ++i)
+		rewind_drop(rw, rewind_frame(rw, i));
+	free(rw->frames);
+	free(rw->key);
+	free(rw->state);
+	free(rw->scratch);
+	memset(rw, 0, sizeof(*rw));
+}
+
+void
+rewind_push(struct rewind_buffer *rw, struct CHIP8 *chip8)
+{
+	// Dropping the oldest keyframe makes the deltas against it useless,
+	// so those go too.
+	if (rw->len == rw->cap) {
+		do {
+			rewind_drop(rw, rewind_frame(rw, 0));
+			rw->tail = (rw->tail + 1) % rw->cap;
+			rw->len -= 1;
+		} while (rw->len > 0 && !rewind_frame(rw, 0)->key);
+	}
+
+	bool key = rw->len == 0 || rw->since_key >= rw->interval;
+	uint8_t *state = rw->state;
+	rewind_save(chip8, state);
+
+	if (key) {
+		memcpy(rw->key, state, REWIND_STATE);
+		rw->since_key = 0;
+	} else {
+		for (size_t i = 0; i < REWIND_STATE; ++i)
+			state[i] ^= rw->key[i];
+	}
+	rw->since_key += 1;
+
+	size_t len = rle_encode(state, REWIND_STATE, rw->scratch);
+
+	struct rewind_frame *frame = rewind_frame(rw, rw->len);
+	frame->data = ecalloc(len, 1);
+	frame->len = len;
+	frame->key = key;
+	memcpy(frame->data, rw->scratch, len);
+
+	rw->len += 1;
+	rw->bytes += len;
+}
+
+// Drop the newest frame and load the one before it into chip8. Returns
+// false if there's nothing further back to go to.
+bool
+rewind_step_back(struct rewind_buffer *rw, struct CHIP8 *chip8)
+{
+	if (rw->len < 2)
+		return false;
+
+	rewind_drop(rw, rewind_frame(rw, rw->len - 1));
+	rw->len -= 1;
+
+	size_t k = rw->len - 1;
+	while (!rewind_frame(rw, k)->key)
+		--k;
+
+	struct rewind_frame *key = rewind_frame(rw, k);
+	struct rewind_frame *frame = rewind_frame(rw, rw->len - 1);
+	rle_decode(key->data, key->len, rw->key, false);
+
+	uint8_t *state = rw->state;
+	memcpy(state, rw->key, REWIND_STATE);
+	if (frame != key)
+		rle_decode(frame->data, frame->len, state, true);
+
+	rw->since_key = rw->len - k;
+	rewind_load(chip8, state);
+	return true;
+}
@@ -0,0 +1,35 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+struct rewind_frame {
+	uint8_t *data;  // RLE of the state XOR its keyframe, or of the state itself
+	size_t   len;
+	bool     key;
+};
+
+struct rewind_buffer {
+	struct rewind_frame *frames; // ring buffer, oldest at `tail`
+	size_t   cap;
+	size_t   tail;
+	size_t   len;
+	size_t   interval;  // frames per keyframe
+	size_t   since_key; // frames pushed since the newest keyframe
+	size_t   bytes;     // total encoded size of all frames
+
+	uint8_t *key;       // the newest keyframe, decoded
+	uint8_t *state;
+	uint8_t *scratch;   // room for the worst-case encoding of a frame
+};
+
+void rewind_init(struct rewind_buffer *rw, size_t frames, size_t interval);
+void rewind_free(struct rewind_buffer *rw);
+void rewind_push(struct rewind_buffer *rw, struct CHIP8 *chip8);
+bool rewind_step_back(struct rewind_buffer *rw, struct CHIP8 *chip8);
+
+#endif
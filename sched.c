@@ -0,0 +1,135 @@
+// Frame pacing shared by the frontends.
+//
+// Frame N is due at start + N/hz on the monotonic clock, computed from
+// scratch every time, so neither rounding of the period nor a late wakeup
+// ever adds up to drift: a frame that starts late just gets a shorter
+// sleep before the next. A host that can't keep up runs frames back to
+// back until it has caught up, and only when it is SCHED_MAX_LAG frames
+// behind (the process was stopped, say) does it give up on them; either
+// is counted, and the latter reported by sched_wait(), so that slow
+// emulation never goes unnoticed.
+//
+// At max speed, each frame runs as many instructions as the last frames
+// show fit in 3/4 of a period, and never fewer than `cycles`. The timers
+// still tick at hz, so games run as fast as the host allows without their
+// delays getting any shorter.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "sched.h"
+#include "util.h"
+
+#define NS 1000000000ULL
+
+uint64_t
+sched_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * NS + t.tv_nsec;
+}
+
+static uint64_t
+sched_due(struct sched *s, uint64_t frame)
+{
+	return s->start + (frame * NS / s->hz);
+}
+
+void
+sched_init(struct sched *s, unsigned hz, size_t cycles, bool max_speed)
+{
+	ENSURE(hz != 0 && cycles != 0);
+
+	s->hz = hz;
+	s->cycles = cycles;
+	s->max_speed = max_speed;
+	s->start = sched_now();
+	s->frame = 0;
+	s->frame_start = s->start;
+	s->budget = cycles;
+	s->late = s->dropped = s->oversleep = 0;
+}
+
+// The instructions to run this frame.
+size_t
+sched_budget(struct sched *s)
+{
+	s->frame_start = sched_now();
+	return s->max_speed ? s->budget : s->cycles;
+}
+
+// Start counting frames over from now, after the frontend stopped running
+// them for a while (in a debugger, say) and doesn't want them caught up.
+void
+sched_reset(struct sched *s)
+{
+	s->start = sched_now();
+	s->frame = 0;
+}
+
+// Finish a frame in which `ran` instructions were run. Returns the number
+// of frames skipped, if any.
+size_t
+sched_end(struct sched *s, size_t ran)
+{
+	uint64_t now = sched_now();
+
+	// Adapt only to frames that ran their whole budget: one cut short
+	// by the debugger or an FX0A says nothing about the host's speed.
+	if (s->max_speed && ran >= s->budget) {
+		uint64_t spent = now - s->frame_start;
+		uint64_t target = NS / s->hz * 3 / 4;
+		uint64_t fits = spent == 0 ? s->budget * 2 : ran * target / spent;
+
+		size_t next = (s->budget + fits) / 2;
+		if (next > s->budget * 2) next = s->budget * 2;
+		if (next < s->cycles)     next = s->cycles;
+		s->budget = next;
+	}
+
+	uint64_t due = sched_due(s, ++s->frame);
+	if (now <= due)
+		return 0;
+
+	s->late += 1;
+
+	size_t behind = (now - due) * s->hz / NS;
+	if (behind < SCHED_MAX_LAG)
+		return 0;
+
+	s->dropped += behind;
+	s->start = now;
+	s->frame = 0;
+	return behind;
+}
+
+// When the next frame is due, in sched_now() time. Frontends that wait
+// on something else as well can arm a timerfd with it, in absolute
+// CLOCK_MONOTONIC time.
+uint64_t
+sched_next(struct sched *s)
+{
+	return sched_due(s, s->frame);
+}
+
+// Finish a frame, as sched_end(), and sleep until the next is due.
+size_t
+sched_wait(struct sched *s, size_t ran)
+{
+	size_t dropped = sched_end(s, ran);
+
+	uint64_t due = sched_next(s);
+	if (sched_now() >= due)
+		return dropped;
+
+	struct timespec t = { due / NS, due % NS };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+		;
+	s->oversleep += sched_now() - due;
+
+	return dropped;
+}
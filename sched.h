@@ -0,0 +1,35 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Frames this far behind are given up on rather than caught up with.
+#define SCHED_MAX_LAG 6
+
+struct sched {
+	unsigned  hz;          // frames (timer ticks) per second
+	size_t    cycles;      // instructions per frame, or the least of them at max speed
+	bool      max_speed;   // run as many instructions as fit in a frame
+
+	uint64_t  start;       // CLOCK_MONOTONIC time of frame 0, in ns
+	uint64_t  frame;       // frames since start
+	uint64_t  frame_start; // when the current frame's instructions started
+	size_t    budget;      // instructions for the current frame
+
+	// How the host has kept up.
+	uint64_t  late;        // frames that finished after they were due
+	uint64_t  dropped;     // frames skipped after falling SCHED_MAX_LAG behind
+	uint64_t  oversleep;   // total ns woken up after a frame was due
+};
+
+uint64_t sched_now(void);
+void sched_init(struct sched *s, unsigned hz, size_t cycles, bool max_speed);
+size_t sched_budget(struct sched *s);
+void sched_reset(struct sched *s);
+size_t sched_end(struct sched *s, size_t ran);
+uint64_t sched_next(struct sched *s);
+size_t sched_wait(struct sched *s, size_t ran);
+
+#endif
@@ -7,52 +7,126 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <SDL.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <time.h>
 
 #include "chip8.h"
+#include "movie.h"
+#include "rewind.h"
+#include "sched.h"
+#include "spsc.h"
 #include "util.h"
 #include "font.h"
 
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
 static SDL_Texture *texture = NULL;
+
+// What's in `texture`, so that only the display rows that change have to
+// be redrawn and uploaded.
+static uint32_t framebuffer[128 * 128];
 static SDL_AudioDeviceID device = 0;
 static SDL_AudioSpec *spec = NULL;
 
+// The emulator runs on a thread of its own (emulate()), at 60 frames a
+// second whatever the render thread is doing. Everything from here down
+// to `frames` belongs to it.
+
 static bool debug = true;
 static size_t debug_steps = 0;
 
-// Stolen from danirod/chip8
-struct AudioData {
-	float tone_pos;
-	float tone_inc;
-};
+// Ten seconds of history, with a keyframe every second. Backspace rewinds
+// while held, or steps back a frame per press while paused.
+#define REWIND_FRAMES   600
+#define REWIND_INTERVAL 60
+static struct rewind_buffer history;
+static bool rewinding = false;
 
-void feed(void *udata, uint8_t *stream, int len);
-size_t keydown(char key);
+// The session being recorded with -r, if fp != NULL.
+static struct movie movie;
+
+// The keypad as last read, given to the machine once at the start of
+// every frame so that a frame can be played back with exactly the input
+// it had.
+static uint16_t keypad_next = 0;
 
+// Instructions per frame, at least, with -m.
 size_t tickrate = 1500;
+static struct sched sched;
+
+// What the render thread gets to see of the machine at the end of each
+// frame, handed over through a triple buffer.
+#define INFO_OPS 16
+struct frame {
+	uint64_t display[2][S_D_HEIGHT][S_D_WIDTH / 64];
+	uint64_t dirty_rows; // since the last frame the render thread took
+	bool     hires;
+	uint8_t  vregs[16];
+	uint16_t PC;
+	uint16_t I;
+	uint16_t SC;
+	uint8_t  delay_tmr;
+	uint8_t  sound_tmr;
+	uint8_t  plane;
+	int8_t   wait_key;
+	enum CHIP8_halt halt;
+	bool     debug;
+	bool     rewinding;
+	uint16_t ops[INFO_OPS]; // instructions from PC on
+	size_t   nops;
+#ifdef CHIP8_PROFILER
+	uint64_t op_statistics[I_MAX]; // from the machine's profile
+	uint64_t op_when[I_MAX];
+	uint64_t op_total;
+#endif
+};
 
-bool key_statuses[16] = {0};
-enum CHIP8_inst_type last_op = I_UNKNOWN;
-size_t op_statistics[I_MAX] = {0};
-size_t op_when[I_MAX] = {0};
-size_t op_total = 0;
-enum { INFM_1, INFM_3 } info_mode = INFM_1;
+static struct frame frames[3];
+static struct spsc_triple frames_tb;
+
+// Input from the render thread, applied by the emulation thread at the
+// start of its next frame.
+enum input_type {
+	INPUT_KEYPAD,    // value: the keypad, bit N set if key N is held
+	INPUT_DEBUG,     // toggle the debugger
+	INPUT_STEP,      // run one instruction while paused
+	INPUT_REWIND,    // value: whether Backspace is held
+	INPUT_STEP_BACK, // go back one frame while paused
+};
 
-uint32_t _sdl_tick(uint32_t interval, void *param);
-uint32_t _sdl_tick(uint32_t interval, void *param) {
-	SDL_Event ev;
-	SDL_UserEvent u_ev;
+struct input {
+	enum input_type type;
+	uint16_t value;
+};
 
-	ev.type = SDL_USEREVENT;
-	u_ev.type = SDL_USEREVENT;
-	u_ev.data1 = param;
-	ev.user = u_ev;
+static struct spsc inputs;
+static atomic_bool quit = false;
+
+// Unsigned 8-bit mono samples, rendered by the emulation thread into a
+// ring that the audio callback drains.
+#define AUDIO_RATE    44100
+#define AUDIO_SAMPLES 4096             // per callback
+#define AUDIO_FRAME   (AUDIO_RATE / 60)
+#define AUDIO_RING    16384
+#define AUDIO_SILENCE 128
+#define AUDIO_VOLUME  32
+#define AUDIO_RAMP    44               // samples to fade in or out over, 1 ms
+static struct spsc samples;
+
+// Whether the sound timer was running at the start of the frame being
+// run, and the instructions into it at which it started or stopped since,
+// alternately.
+static bool   sound_on = false;
+static size_t sound_edges[16];
+static size_t nsound_edges = 0;
+
+// Everything from here on belongs to the render thread.
 
-	SDL_PushEvent(&ev);
-	return interval;
-}
+bool key_statuses[16] = {0};
+enum { INFM_1, INFM_3 } info_mode = INFM_1;
+
+void feed(void *udata, uint8_t *stream, int len);
 
 static bool
 init_gui(void)
@@ -82,67 +156,106 @@ init_gui(void)
 	if (texture == NULL)
 		return false;
 
-	struct AudioData *audio = malloc(sizeof(struct AudioData));
-	audio->tone_pos = 0;
-	audio->tone_inc = 2 * 3.14159 * 1000 / 44100;
-
 	// Set up the audiospec data structure required by SDL.
 	spec = (SDL_AudioSpec *) malloc(sizeof(SDL_AudioSpec));
-	spec->freq = 44100;
+	spec->freq = AUDIO_RATE;
 	spec->format = AUDIO_U8;
 	spec->channels = 1;
-	spec->samples = 4096;
+	spec->samples = AUDIO_SAMPLES;
 	spec->callback = *feed;
-	spec->userdata = audio;
+	spec->userdata = &samples;
 
 	device = SDL_OpenAudioDevice(
 		NULL, 0, spec, NULL,
 		SDL_AUDIO_ALLOW_FORMAT_CHANGE
 	);
 
-	SDL_AddTimer((1000 / 60), _sdl_tick, NULL);
-
 	return true;
 }
 
+// Every character of font.h, rasterized once at startup as masks that are
+// all ones where the glyph is set. Each row has a column of gap on the
+// right, so a string is drawn a whole glyph row at a time.
+static uint32_t glyphs[128][FONT_HEIGHT][FONT_WIDTH + 1];
+
+// The opcode heat map's colours, from blue for opcodes that never run to
+// red for one that makes up everything run.
+static uint32_t heat[256];
+
+static void
+init_overlay(void)
+{
+	for (size_t ch = 0; ch < SIZEOF(glyphs); ++ch)
+		for (size_t fy = 0; fy < FONT_HEIGHT; ++fy)
+			for (size_t fx = 0; fx < FONT_WIDTH; ++fx)
+				if (font_data[(ch * FONT_HEIGHT) + fy] & (0x80 >> fx))
+					glyphs[ch][fy][fx] = UINT32_MAX;
+
+	for (size_t i = 0; i < SIZEOF(heat); ++i) {
+		float hue = 240.0f * (SIZEOF(heat) - 1 - i) / (SIZEOF(heat) - 1);
+		heat[i] = (hsl_to_rgb(hue, 100, 50) << 8) | 0xFF;
+	}
+}
+
 static void __attribute__((format(printf, 6, 7)))
 draw_text(uint32_t *pixels, size_t x, size_t y, uint32_t fg, uint32_t bg, char *fmt, ...)
 {
-	const size_t bdf_magic[] = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
-
-	char buf[4096];
-	memset(buf, 0x0, sizeof(buf));
+	char buf[64];
 	va_list ap;
 	va_start(ap, fmt);
 	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
 	ENSURE((size_t) len < sizeof(buf));
 
-	// Set background color.
-	for (size_t dy = y; dy < (y + FONT_HEIGHT + 1); ++dy) {
-		for (size_t dx = x; dx < (x + ((FONT_WIDTH + 1) * len) + 1); ++dx) {
-			pixels[(128 * dy) + dx] = bg;
+	uint32_t diff = fg ^ bg;
+	for (size_t fy = 0; fy < FONT_HEIGHT; ++fy) {
+		uint32_t *row = &pixels[(128 * (y + fy)) + x];
+		*row++ = bg;
+		for (size_t ich = 0; ich < (size_t)len; ++ich) {
+			const uint32_t *glyph = glyphs[buf[ich] & 0x7F][fy];
+			for (size_t fx = 0; fx < FONT_WIDTH + 1; ++fx)
+				*row++ = bg ^ (diff & glyph[fx]);
 		}
 	}
 
-	for (size_t startx = x + 1, ich = 0; ich < (size_t)len; ++ich) {
-		char ch = buf[ich];
+	// Set background color of the row below.
+	for (size_t dx = x; dx < (x + ((FONT_WIDTH + 1) * len) + 1); ++dx)
+		pixels[(128 * (y + FONT_HEIGHT)) + dx] = bg;
+}
 
-		for (size_t dy = y, fy = 0; fy < FONT_HEIGHT; ++fy, ++dy) {
-			uint8_t font_row = font_data[(ch * FONT_HEIGHT) + fy];
+static void
+draw_cell(uint32_t *pixels, size_t x, size_t y, uint32_t c)
+{
+	pixels[128 * (y + 0) + (x + 0)] = c;
+	pixels[128 * (y + 0) + (x + 1)] = c;
+	pixels[128 * (y + 1) + (x + 0)] = c;
+	pixels[128 * (y + 1) + (x + 1)] = c;
+}
 
-			for (size_t dx = startx, fx = 0; fx < FONT_WIDTH; ++fx, ++dx) {
-				bool font_px = (font_row & bdf_magic[fx]) != 0;
-				pixels[(128 * dy) + dx] = font_px ? fg : bg;
-			}
-		}
+// The value each field of the info panel was last drawn with. Fields are
+// numbered in the order draw() comes to them, which is always the same for
+// a given info_mode; draw() redraws one only when its value has changed,
+// and uploads the panel only when any has.
+static uint64_t panel[256];
+static size_t panel_field;
+static bool panel_changed;
 
-		startx += FONT_WIDTH + 1;
+static bool
+panel_update(uint64_t value)
+{
+	ENSURE(panel_field < SIZEOF(panel));
+	if (panel[panel_field] == value) {
+		++panel_field;
+		return false;
 	}
+
+	panel[panel_field++] = value;
+	panel_changed = true;
+	return true;
 }
 
 static void
-draw(struct CHIP8 *chip8)
+draw(struct frame *frame)
 {
 	const uint32_t colors[] = {
 		0x001000ff, // backColor
@@ -153,58 +266,50 @@ draw(struct CHIP8 *chip8)
 	const uint32_t d_fg = 0x001000ff; // fg for debug text
 	const uint32_t d_bg = 0xeeeeeeff; // bg for debug text
 
-	uint32_t *pixels;
-	int       pitch;
-
-	SDL_LockTexture(texture, NULL, (void *)&pixels, &pitch);
-
-	// Expand pixels
-	if (chip8->hires) {
-		for (size_t i = 0; i < (S_D_HEIGHT*S_D_WIDTH); ++i)
-			pixels[i] = colors[chip8->display[i]];
-	} else {
-		size_t x = 0;
-		size_t y = 0;
-		for (size_t i = 0; i < (C_D_HEIGHT*C_D_WIDTH); ++i) {
-			uint32_t val = colors[chip8->display[i]];
-			pixels[128 * (2 * y + 0) + (2 * x + 0)] = val;
-			pixels[128 * (2 * y + 0) + (2 * x + 1)] = val;
-			pixels[128 * (2 * y + 1) + (2 * x + 0)] = val;
-			pixels[128 * (2 * y + 1) + (2 * x + 1)] = val;
-
-			x += 1;
-
-			if (x == D_WIDTH) {
-				x = 0;
-				y += 1;
-			}
+	uint32_t *pixels = framebuffer;
 
-			if (y == D_HEIGHT) {
-				break;
-			}
-		}
+	// Expand the rows that changed, and upload only the texture rows
+	// between the first and last of them.
+	size_t first, last;
+	if (chip8_display_expand(frame->display, frame->dirty_rows, frame->hires,
+	    colors, pixels, &first, &last)) {
+		SDL_Rect rect = { 0, first, S_D_WIDTH, last - first };
+		SDL_UpdateTexture(texture, &rect, &pixels[128 * first], 128 * sizeof(uint32_t));
 	}
 
-	// Set background color of information area to white.
-	for (size_t dy = S_D_HEIGHT; dy < 128; ++dy)
-		for (size_t dx = 0; dx < S_D_WIDTH; ++dx)
-			pixels[(128 * dy) + dx] = d_bg;
+	// Start the panel over when switching modes.
+	static int panel_mode = -1;
+	if (panel_mode != (int)info_mode) {
+		panel_mode = info_mode;
+		memset(panel, 0xFF, sizeof(panel));
+
+		// Set background color of information area to white.
+		for (size_t dy = S_D_HEIGHT; dy < 128; ++dy)
+			for (size_t dx = 0; dx < S_D_WIDTH; ++dx)
+				pixels[(128 * dy) + dx] = d_bg;
+	}
+	panel_field = 0;
+	panel_changed = false;
 
 	switch (info_mode) {
 	break; case INFM_1: {
 		// Draw instruction queue.
 		for (
-			size_t y = S_D_HEIGHT + 4, ipc = chip8->PC;
-			y < (127 - FONT_HEIGHT) && ipc < SIZEOF(chip8->memory);
-			y += FONT_HEIGHT + 1
+			size_t y = S_D_HEIGHT + 4, i = 0;
+			y < (127 - FONT_HEIGHT);
+			y += FONT_HEIGHT + 1, ++i
 		) {
-			struct CHIP8_inst inst = chip8_next(chip8, ipc);
-			draw_text(
-				pixels, 1, y, d_fg,
-				ipc == chip8->PC ? 0xb9bab9ff : d_bg,
-				"%04X", inst.op
-			);
-			ipc += inst.op_len;
+			if (!panel_update(i < frame->nops ? frame->ops[i] : UINT32_MAX))
+				continue;
+			if (i < frame->nops) {
+				draw_text(
+					pixels, 1, y, d_fg,
+					i == 0 ? 0xb9bab9ff : d_bg,
+					"%04X", frame->ops[i]
+				);
+			} else {
+				draw_text(pixels, 1, y, d_fg, d_bg, "    ");
+			}
 		}
 
 		// Draw registers.
@@ -213,77 +318,110 @@ draw(struct CHIP8 *chip8)
 			y < (127 - FONT_HEIGHT) && r < 8;
 			y += FONT_HEIGHT + 1, ++r
 		) {
+			if (!panel_update(frame->vregs[r] | (frame->vregs[r + 8] << 8)))
+				continue;
 			draw_text(
 				pixels, 8 * FONT_WIDTH, y, d_fg, d_bg,
 				"v%X:%04X  v%X:%04X",
-				r, chip8->vregs[r], r + 8, chip8->vregs[r + 8]
+				r, frame->vregs[r], r + 8, frame->vregs[r + 8]
 			);
 		}
 
 		size_t y = S_D_HEIGHT + 4;
 		size_t x = (19 * (FONT_WIDTH + 2)) - 1;
 
-		draw_text(pixels, x, y, d_fg, d_bg, "plane:%02X", chip8->plane);
+		if (panel_update(frame->plane))
+			draw_text(pixels, x, y, d_fg, d_bg, "plane:%02X", frame->plane);
 		y += FONT_HEIGHT + 1;
-		draw_text(pixels, x, y, d_fg, d_bg, "delay:%02X", chip8->delay_tmr);
+		if (panel_update(frame->delay_tmr))
+			draw_text(pixels, x, y, d_fg, d_bg, "delay:%02X", frame->delay_tmr);
 		y += FONT_HEIGHT + 1;
-		draw_text(pixels, x, y, d_fg, d_bg, " I: %04X", chip8->I);
+		if (panel_update(frame->I))
+			draw_text(pixels, x, y, d_fg, d_bg, " I: %04X", frame->I);
 		y += FONT_HEIGHT + 1;
-		draw_text(pixels, x, y, d_fg, d_bg, "PC: %04X", chip8->PC);
+		if (panel_update(frame->PC))
+			draw_text(pixels, x, y, d_fg, d_bg, "PC: %04X", frame->PC);
 		y += FONT_HEIGHT + 1;
-		draw_text(pixels, x, y, d_fg, d_bg, "SC: %04X", chip8->SC);
+		if (panel_update(frame->SC))
+			draw_text(pixels, x, y, d_fg, d_bg, "SC: %04X", frame->SC);
 		y += FONT_HEIGHT + 1;
 
-		draw_text(pixels, x, y,
-			d_bg,
-			chip8->hires ? 0x8e8f2cff : 0xb9bab9ff,
-			" #HIRES "
-		); y += FONT_HEIGHT + 1;
-
-		draw_text(pixels, x, y,
-			d_bg,
-			chip8->wait_key != -1 ? 0x2c2c8eff : 0xb9bab9ff,
-			" #INPUT "
-		); y += FONT_HEIGHT + 1;
-
-		draw_text(pixels, x, y,
-			d_bg,
-			chip8->sound_tmr > 0 ? 0x8e2c2cff : 0xb9bab9ff,
-			" #SOUND "
-		); y += FONT_HEIGHT + 1;
+		if (panel_update(frame->hires))
+			draw_text(pixels, x, y,
+				d_bg,
+				frame->hires ? 0x8e8f2cff : 0xb9bab9ff,
+				" #HIRES "
+			);
+		y += FONT_HEIGHT + 1;
+
+		if (panel_update(frame->wait_key != -1))
+			draw_text(pixels, x, y,
+				d_bg,
+				frame->wait_key != -1 ? 0x2c2c8eff : 0xb9bab9ff,
+				" #INPUT "
+			);
+		y += FONT_HEIGHT + 1;
+
+		if (panel_update(frame->sound_tmr > 0))
+			draw_text(pixels, x, y,
+				d_bg,
+				frame->sound_tmr > 0 ? 0x8e2c2cff : 0xb9bab9ff,
+				" #SOUND "
+			);
+		y += FONT_HEIGHT + 1;
 	} break; case INFM_3: {
 		size_t y = S_D_HEIGHT + 4;
 
-		draw_text(pixels, 1, y,
-			d_bg,
-			chip8->hires ? 0x8e8f2cff : 0xb9bab9ff,
-			" #HIRES "
-		); y += FONT_HEIGHT + 1;
-
-		draw_text(pixels, 1, y,
-			d_bg,
-			chip8->wait_key != -1 ? 0x2c2c8eff : 0xb9bab9ff,
-			" #INPUT "
-		); y += FONT_HEIGHT + 1;
-
-		draw_text(pixels, 1, y,
-			d_bg,
-			chip8->sound_tmr > 0 ? 0x8e2c2cff : 0xb9bab9ff,
-			" #SOUND "
-		); y += FONT_HEIGHT + 1;
-
-		draw_text(pixels, 1, y,
-			d_bg,
-			debug ? 0x000000ff : 0xb9bab9ff,
-			" #DEBUG "
-		); y += FONT_HEIGHT + 1;
-
-		draw_text(pixels, 1, y,
-			d_bg,
-			chip8->halt ? 0xff5050ff : 0xb9bab9ff,
-			" HALTED "
-		); y += FONT_HEIGHT + 1;
+		if (panel_update(frame->hires))
+			draw_text(pixels, 1, y,
+				d_bg,
+				frame->hires ? 0x8e8f2cff : 0xb9bab9ff,
+				" #HIRES "
+			);
+		y += FONT_HEIGHT + 1;
+
+		if (panel_update(frame->wait_key != -1))
+			draw_text(pixels, 1, y,
+				d_bg,
+				frame->wait_key != -1 ? 0x2c2c8eff : 0xb9bab9ff,
+				" #INPUT "
+			);
+		y += FONT_HEIGHT + 1;
+
+		if (panel_update(frame->sound_tmr > 0))
+			draw_text(pixels, 1, y,
+				d_bg,
+				frame->sound_tmr > 0 ? 0x8e2c2cff : 0xb9bab9ff,
+				" #SOUND "
+			);
+		y += FONT_HEIGHT + 1;
+
+		if (panel_update(frame->debug))
+			draw_text(pixels, 1, y,
+				d_bg,
+				frame->debug ? 0x000000ff : 0xb9bab9ff,
+				" #DEBUG "
+			);
+		y += FONT_HEIGHT + 1;
 
+		if (panel_update(frame->halt != HALT_NONE))
+			draw_text(pixels, 1, y,
+				d_bg,
+				frame->halt ? 0xff5050ff : 0xb9bab9ff,
+				" HALTED "
+			);
+		y += FONT_HEIGHT + 1;
+
+		if (panel_update(frame->rewinding))
+			draw_text(pixels, 1, y,
+				d_bg,
+				frame->rewinding ? 0x2c8e2cff : 0xb9bab9ff,
+				" REWIND "
+			);
+		y += FONT_HEIGHT + 1;
+
+#ifdef CHIP8_PROFILER
+		// How much of everything run each opcode makes up.
 		for (
 			size_t starty = S_D_HEIGHT + 4,
 			       startx = 8 * (FONT_WIDTH + 2),
@@ -291,17 +429,13 @@ draw(struct CHIP8 *chip8)
 			i < I_MAX;
 			++i
 		) {
-			float percent = ((float)op_statistics[i]) * 100 / op_total;
-			size_t hue = (1.0 - percent) * 240;
-			uint32_t c = (hsl_to_rgb((float)hue, 100, 50) << 8) | 0xFF;
-			size_t yy = i / 7;
-			size_t xx = i % 7;
-			pixels[128 * (2 * yy + 0 + starty) + (2 * xx + 0 + startx)] = c;
-			pixels[128 * (2 * yy + 0 + starty) + (2 * xx + 1 + startx)] = c;
-			pixels[128 * (2 * yy + 1 + starty) + (2 * xx + 0 + startx)] = c;
-			pixels[128 * (2 * yy + 1 + starty) + (2 * xx + 1 + startx)] = c;
+			size_t share = frame->op_total == 0 ? 0
+				: frame->op_statistics[i] * (SIZEOF(heat) - 1) / frame->op_total;
+			if (panel_update(share))
+				draw_cell(pixels, 2 * (i % 7) + startx, 2 * (i / 7) + starty, heat[share]);
 		}
 
+		// How long ago each opcode last ran, fading out over ten frames.
 		for (
 			size_t starty = S_D_HEIGHT + 4 + (7 * 2) + 7,
 			       startx = 8 * (FONT_WIDTH + 2),
@@ -309,17 +443,13 @@ draw(struct CHIP8 *chip8)
 			i < I_MAX;
 			++i
 		) {
-			float since = MAX((tickrate*10), op_total - op_when[i]);
-			uint8_t gray = MAX((d_bg & 0xFFFF) >> 8,
-					(uint8_t)(255 * ((float)since / (tickrate*10))));
+			size_t since = MAX((tickrate*10), frame->op_total - frame->op_when[i]);
+			uint32_t gray = MAX((d_bg & 0xFFFF) >> 8, 255 * since / (tickrate*10));
 			uint32_t c = (gray << 24) | (gray << 16) | (gray << 8) | 0xFF;
-			size_t yy = i / 7;
-			size_t xx = i % 7;
-			pixels[128 * (2 * yy + 0 + starty) + (2 * xx + 0 + startx)] = c;
-			pixels[128 * (2 * yy + 0 + starty) + (2 * xx + 1 + startx)] = c;
-			pixels[128 * (2 * yy + 1 + starty) + (2 * xx + 0 + startx)] = c;
-			pixels[128 * (2 * yy + 1 + starty) + (2 * xx + 1 + startx)] = c;
+			if (panel_update(gray))
+				draw_cell(pixels, 2 * (i % 7) + startx, 2 * (i / 7) + starty, c);
 		}
+#endif
 
 		for (
 			size_t starty = S_D_HEIGHT + 4,
@@ -331,58 +461,117 @@ draw(struct CHIP8 *chip8)
 			uint32_t c = key_statuses[i] ? 0x000000ff : 0xb9bab9ff;
 			size_t yy = starty + ((i / 4) * (FONT_HEIGHT + 1));
 			size_t xx = startx + ((i % 4) * (FONT_WIDTH  + 2));
-			draw_text(pixels, xx, yy, d_bg, c, "%X", i);
+			if (panel_update(key_statuses[i]))
+				draw_text(pixels, xx, yy, d_bg, c, "%X", (unsigned)i);
 		}
 	} break; default: {
 	} break;
 	}
 
-	SDL_UnlockTexture(texture);
+	if (panel_changed) {
+		SDL_Rect info = { 0, S_D_HEIGHT, 128, 128 - S_D_HEIGHT };
+		SDL_UpdateTexture(texture, &info, &pixels[128 * S_D_HEIGHT], 128 * sizeof(uint32_t));
+	}
+
 	SDL_RenderClear(renderer);
 	SDL_RenderCopy(renderer, texture, NULL, NULL);
 	SDL_RenderPresent(renderer);
 }
 
-static void
+static uint64_t
 load(struct CHIP8 *chip8, char *filename)
 {
 	struct stat st;
-	stat(filename, &st); // TODO: assert that retcode != 0
+	if (stat(filename, &st) != 0)
+		die("Could not stat %%s:", filename);
+	if ((size_t)st.st_size > sizeof(((struct CHIP8 *)0)->memory) - ROM_START)
+		die("%%s is too large (%%zu bytes)", filename, (size_t)st.st_size);
 
-	char *src = malloc(st.st_size);
+	char *src = ecalloc(st.st_size, sizeof(char));
 	FILE *src_f = fopen(filename, "rb");
+	if (src_f == NULL)
+		die("Could not open %%s:", filename);
 	fread(src, sizeof(char), st.st_size, src_f);
 	fclose(src_f);
 
 	chip8_load(chip8, src, st.st_size);
+	uint64_t hash = fnv1a(src, st.st_size, FNV1A_INIT);
 
 	free(src);
+	return hash;
 }
 
-// Stolen from danirod/chip8 :/
-//
-// This is the function that generates the beep noise heard in the emulator.
-// It generates RAW PCM values that are written to the stream. This is fast
-// and has no dependencies on external files.
-//
+// The audio callback: hand over what the emulation thread has rendered,
+// and silence for whatever it hasn't (it was stopped, say).
 void
 feed(void *udata, uint8_t *stream, int len)
 {
-	struct AudioData *audio = (struct AudioData *)udata;
-	for (int i = 0; i < len; ++i) {
-		stream[i] = sinf(audio->tone_pos) + 127;
-		audio->tone_pos += audio->tone_inc;
-	}
+	size_t n = spsc_read(udata, stream, len);
+	memset(&stream[n], AUDIO_SILENCE, len - n);
 }
 
+// Render a frame's worth of audio into `samples`, from the frame that ran
+// `ran` instructions: the pattern at the current pitch while the sound
+// timer was running, silence otherwise, or throughout if not `audible`.
+//
+// The timer's edges are placed within the frame by the instruction they
+// happened at, so a beep starts and stops on the sample, and is ramped in
+// and out over AUDIO_RAMP samples rather than clicking.
+//
+// The device takes AUDIO_SAMPLES at a time, so the ring is filled that
+// far ahead (and a couple of frames more) before the first callback, and
+// again after running dry. From then on a frame adds a frame's worth;
+// the device's clock and ours drift apart, so a little more or less is
+// added when the fill strays too far from that.
 static void
-sound(bool enabled)
+emulate_audio(struct CHIP8 *chip8, size_t ran, bool audible)
 {
-	SDL_PauseAudioDevice(device, !enabled);
+	static uint32_t phase = 0; // position in the pattern, in 1/65536ths of a sample
+	static uint32_t step = 0;
+	static int pitch = -1;
+	static uint32_t ramp = 0;  // 0 (silent) to AUDIO_RAMP (full volume)
+
+	uint8_t buf[AUDIO_SAMPLES + AUDIO_FRAME * 3];
+	size_t n = AUDIO_FRAME;
+
+	size_t fill = spsc_count(&samples);
+	if (fill == 0) {
+		n = AUDIO_SAMPLES + AUDIO_FRAME * 2;
+	} else if (fill < AUDIO_SAMPLES / 2) {
+		n += AUDIO_FRAME / 100;
+	} else if (fill > AUDIO_SAMPLES * 3) {
+		n -= AUDIO_FRAME / 100;
+	}
+
+	if (chip8->pitch != pitch) {
+		pitch = chip8->pitch;
+		step = 4000 * powf(2, (pitch - 64) / 48.0f) / AUDIO_RATE * 65536;
+	}
+
+	bool on = sound_on;
+	size_t edge = 0;
+
+	for (size_t i = 0; i < n; ++i, phase += step) {
+		// Sample i is (i * ran / n) instructions into the frame.
+		for (; edge < nsound_edges && sound_edges[edge] * n <= i * ran; ++edge)
+			on = !on;
+
+		if (on && audible && ramp < AUDIO_RAMP) ++ramp;
+		if (!(on && audible) && ramp > 0) --ramp;
+
+		size_t bit = (phase >> 16) & 127;
+		bool set = (chip8->pattern[bit >> 3] >> (7 - (bit & 7))) & 1;
+		uint32_t amplitude = AUDIO_VOLUME * ramp / AUDIO_RAMP;
+		buf[i] = set ? AUDIO_SILENCE + amplitude : AUDIO_SILENCE - amplitude;
+	}
+	spsc_write(&samples, buf, n);
+
+	sound_on = chip8->sound_tmr > 0;
+	nsound_edges = 0;
 }
 
-size_t
-keydown(char key)
+static uint16_t
+read_keypad(void)
 {
 	char keys[] = {
 		SDL_SCANCODE_X, // 0
@@ -403,18 +592,159 @@ keydown(char key)
 		SDL_SCANCODE_V  // F
 	};
 
-	if (key > 15) return 0;
-
 	const uint8_t *sdl_keys = SDL_GetKeyboardState(NULL);
-	uint8_t scancode = keys[(size_t)key];
-	return sdl_keys[scancode];
-	//return (size_t)key_statuses[(size_t)key];
+	uint16_t pad = 0;
+	for (size_t i = 0; i < SIZEOF(keys); ++i)
+		if (sdl_keys[(size_t)keys[i]]) pad |= 1 << i;
+	return pad;
+}
+
+static void
+emulate_input(struct CHIP8 *chip8)
+{
+	static bool rewind_held = false;
+	struct input in;
+
+	while (spsc_pop(&inputs, &in)) {
+		switch (in.type) {
+		break; case INPUT_KEYPAD:
+			keypad_next = in.value;
+		break; case INPUT_DEBUG:
+			debug = !debug;
+		break; case INPUT_STEP:
+			debug_steps += 1;
+		break; case INPUT_REWIND:
+			rewind_held = in.value;
+		break; case INPUT_STEP_BACK:
+			if (debug && movie.fp == NULL)
+				rewind_step_back(&history, chip8);
+		}
+	}
+
+	rewinding = rewind_held && !debug && movie.fp == NULL;
 }
 
-// Because I'm an idiot with SDL, I stole this function wholesale from:
+// Run a frame of up to `budget` instructions, and return how many ran.
+static size_t
+emulate_frame(struct CHIP8 *chip8, size_t budget)
+{
+	if (rewinding) {
+		rewind_step_back(&history, chip8);
+		return 0;
+	}
+
+	// A recorded frame has to run whole, so the debugger can only
+	// pause between them.
+	if (movie.fp != NULL && debug)
+		return 0;
+
+	chip8_keypad(chip8, keypad_next);
+
+	size_t steps;
+	for (
+		steps = 0;
+		(!debug || (debug && debug_steps > 0)) && steps < budget;
+		++steps
+	) {
+		chip8_step(chip8);
+		if (debug && debug_steps > 0) debug_steps -= 1;
+
+		bool playing = sound_on ^ (nsound_edges & 1);
+		if ((chip8->sound_tmr > 0) != playing && nsound_edges < SIZEOF(sound_edges))
+			sound_edges[nsound_edges++] = steps + 1;
+	}
+
+	chip8_tick(chip8);
+	if (movie.fp != NULL)
+		movie_frame(&movie, chip8, chip8->keypad);
+	if (steps > 0)
+		rewind_push(&history, chip8);
+
+	return steps;
+}
+
+// Hand the machine's state over to the render thread, and wake it up.
+static void
+publish(struct CHIP8 *chip8)
+{
+	// Rows changed in frames the render thread never got to see.
+	static uint64_t skipped_rows = 0;
+
+	struct frame *frame = &frames[frames_tb.back];
+
+	memcpy(frame->display, chip8->display, sizeof(frame->display));
+	frame->dirty_rows = chip8->dirty_rows | skipped_rows;
+	chip8->dirty_rows = 0;
+	frame->hires = chip8->hires;
+
+	memcpy(frame->vregs, chip8->vregs, sizeof(frame->vregs));
+	frame->PC = chip8->PC;
+	frame->I = chip8->I;
+	frame->SC = chip8->SC;
+	frame->delay_tmr = chip8->delay_tmr;
+	frame->sound_tmr = chip8->sound_tmr;
+	frame->plane = chip8->plane;
+	frame->wait_key = chip8->wait_key;
+	frame->halt = chip8->halt;
+	frame->debug = debug;
+	frame->rewinding = rewinding;
+
+	frame->nops = 0;
+	for (size_t pc = chip8->PC; frame->nops < INFO_OPS && pc < SIZEOF(chip8->memory);) {
+		struct CHIP8_inst inst = chip8_next(chip8, pc);
+		frame->ops[frame->nops++] = inst.op;
+		pc += inst.op_len;
+	}
+
+#ifdef CHIP8_PROFILER
+	memcpy(frame->op_statistics, chip8->profile->types, sizeof(frame->op_statistics));
+	memcpy(frame->op_when, chip8->profile->last, sizeof(frame->op_when));
+	frame->op_total = chip8->profile->ops;
+#endif
+
+	skipped_rows = 0;
+	if (spsc_triple_publish(&frames_tb))
+		skipped_rows = frames[frames_tb.back].dirty_rows;
+
+	SDL_Event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = SDL_USEREVENT;
+	SDL_PushEvent(&ev);
+}
+
+// The emulation thread, paced by `sched`.
+static int
+emulate(void *data)
+{
+	struct CHIP8 *chip8 = data;
+
+	while (!atomic_load(&quit)) {
+		emulate_input(chip8);
+		size_t ran = emulate_frame(chip8, sched_budget(&sched));
+		emulate_audio(chip8, ran, !rewinding && !debug);
+		publish(chip8);
+
+		size_t dropped = sched_wait(&sched, ran);
+		if (dropped != 0)
+			log("fell %zu frames behind, skipped them", dropped);
+	}
+
+	return 0;
+}
+
+static void
+send_input(enum input_type type, uint16_t value)
+{
+	struct input in = { type, value };
+	if (!spsc_push(&inputs, &in))
+		log("input queue full, dropped input %d", type);
+}
+
+// The render thread: input and drawing. Because I'm an idiot with SDL, I
+// stole the start of this function wholesale from:
 //    - https://github.com/danirod/chip8
 static void
-exec(struct CHIP8 *chip8)
+exec(void)
 {
 	const char keys[] = {
 		SDLK_x, // 0
@@ -436,13 +766,13 @@ exec(struct CHIP8 *chip8)
 	};
 
 	ssize_t kcode;
-	bool quit = false;
+	uint16_t pad = 0;
 	SDL_Event ev;
 
-	while (SDL_WaitEvent(&ev) && !quit) {
+	while (!atomic_load(&quit) && SDL_WaitEvent(&ev)) {
 		switch (ev.type) {
 		break; case SDL_QUIT:
-			quit = true;
+			atomic_store(&quit, true);
 		break; case SDL_KEYDOWN:
 			kcode = ev.key.keysym.sym;
 
@@ -452,16 +782,22 @@ exec(struct CHIP8 *chip8)
 					break;
 				}
 			}
+
+			if (kcode == SDLK_BACKSPACE) {
+				send_input(INPUT_STEP_BACK, 0);
+				if (!ev.key.repeat)
+					send_input(INPUT_REWIND, true);
+			}
 		break; case SDL_KEYUP:
 			kcode = ev.key.keysym.sym;
 
 			switch (kcode) {
 			break; case SDLK_ESCAPE:
-				quit = true;
+				atomic_store(&quit, true);
 			break; case SDLK_F1:
-				debug = !debug;
+				send_input(INPUT_DEBUG, 0);
 			break; case SDLK_F2:
-				debug_steps += 1;
+				send_input(INPUT_STEP, 0);
 			break; case SDLK_F9:
 				switch (info_mode) {
 				break; case INFM_1:
@@ -471,65 +807,76 @@ exec(struct CHIP8 *chip8)
 				break; default:
 				break;
 				}
+			break; case SDLK_BACKSPACE:
+				send_input(INPUT_REWIND, false);
 			break; default:
 				for (size_t i = 0; i < SIZEOF(keys); ++i) {
 					if (kcode == keys[i]) {
 						key_statuses[i] = false;
-						if (chip8->wait_key != -1) {
-							chip8->vregs[chip8->wait_key] = i;
-							chip8->wait_key = -1;
-						}
 						break;
 					}
 				}
 			break;
 			}
 		break; case SDL_USEREVENT:
-			for (
-				size_t i = 0;
-				(!debug || (debug && debug_steps > 0)) && i < tickrate;
-				++i
-			) {
-				struct CHIP8_inst current_inst = chip8_next(chip8, chip8->PC);
-				op_total += 1;
-				last_op = current_inst.type;
-				op_statistics[current_inst.type] += 1;
-				op_when[current_inst.type] = op_total;
-
-				chip8_step(chip8);
-				if (debug && debug_steps > 0) debug_steps -= 1;
-			}
-
+			// Only the latest frame matters.
 			SDL_FlushEvent(SDL_USEREVENT);
-
-			if (chip8->delay_tmr > 0) --chip8->delay_tmr;
-			if (chip8->sound_tmr > 0) --chip8->sound_tmr;
-
-			sound(chip8->sound_tmr > 0);
-
-			draw(chip8);
+			if (spsc_triple_acquire(&frames_tb))
+				draw(&frames[frames_tb.front]);
 		break; default:
 		break;
 		}
+
+		if ((ev.type == SDL_KEYDOWN || ev.type == SDL_KEYUP) && read_keypad() != pad) {
+			pad = read_keypad();
+			send_input(INPUT_KEYPAD, pad);
+		}
 	}
 }
 
 static void
 fini(void)
 {
-	if (spec     != NULL) { free(spec->userdata); free(spec); }
+	if (spec     != NULL) { free(spec);                       }
 	if (device   !=    0) { SDL_CloseAudioDevice(device);     }
 	if (texture  != NULL) { SDL_DestroyTexture(texture);      }
 	if (renderer != NULL) { SDL_DestroyRenderer(renderer);    }
 	if (window   != NULL) { SDL_DestroyWindow(window);        }
 	SDL_Quit();
+	rewind_free(&history);
+	movie_close(&movie);
 }
 
 int
 main(int argc, char **argv)
 {
 	char *filename = "ibm.ch8";
-	if (argc > 1) filename = argv[1];
+	char *movie_file = NULL;
+	bool max_speed = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "r:c:m")) != -1) {
+		switch (opt) {
+		break; case 'r':
+			movie_file = optarg;
+		break; case 'c':
+			tickrate = strtoull(optarg, NULL, 0);
+		break; case 'm':
+			max_speed = true;
+		break; default:
+			fprintf(stderr, "usage: %s [-r movie] [-c cycles] [-m] [rom]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) filename = argv[optind];
+	if (tickrate == 0)
+		die("-c needs at least one instruction per frame");
+
+	// A movie's frames all have to be the same length.
+	if (movie_file != NULL && max_speed)
+		die("-r and -m can't be used together");
+
+	init_overlay();
 
 	bool sdl_error = !init_gui();
 	if (sdl_error) {
@@ -539,11 +886,49 @@ main(int argc, char **argv)
 
 	struct CHIP8 chip8;
 
-	chip8_init(&chip8, keydown);
-	draw(&chip8);
-	load(&chip8, filename);
-	exec(&chip8);
+	chip8_init(&chip8);
+	uint64_t rom_hash = load(&chip8, filename);
+	uint64_t seed = time(NULL);
+	chip8_seed(&chip8, seed);
+#ifdef CHIP8_PROFILER
+	chip8_profile_start(&chip8);
+#endif
+
+	if (movie_file != NULL && !movie_record(&movie, movie_file, seed, rom_hash, tickrate))
+		die("Could not create %s:", movie_file);
+
+	rewind_init(&history, REWIND_FRAMES, REWIND_INTERVAL);
+	rewind_push(&history, &chip8);
+
+	spsc_init(&inputs, sizeof(struct input), 64);
+	spsc_init(&samples, sizeof(uint8_t), AUDIO_RING);
+
+	// The device runs from here on: no sound is silence rendered into
+	// `samples`, not a paused device.
+	SDL_PauseAudioDevice(device, 0);
+	spsc_triple_init(&frames_tb);
+
+	sched_init(&sched, 60, tickrate, max_speed);
+	SDL_Thread *emulator = SDL_CreateThread(emulate, "emulator", &chip8);
+	if (emulator == NULL)
+		die("Could not start the emulation thread: %s", SDL_GetError());
+
+	exec();
+	atomic_store(&quit, true);
+	SDL_WaitThread(emulator, NULL);
+
+	if (sched.late != 0)
+		log("%llu frames ran late, %llu of them were skipped",
+			(unsigned long long)sched.late, (unsigned long long)sched.dropped);
+
 	fini();
+#ifdef CHIP8_PROFILER
+	chip8_profile_dump(&chip8, CHIP8_PROFILE_FILE);
+	chip8_profile_fold(&chip8, CHIP8_FOLDED_FILE);
+	chip8_profile_stop(&chip8);
+#endif
+	spsc_free(&inputs);
+	spsc_free(&samples);
 
 	return 0;
 }
@@ -0,0 +1,134 @@
+// Copy-on-write snapshots of a machine.
+//
+// A snapshot holds a copy of everything in struct CHIP8 before `snap`
+// (registers, stack, display: about 2 KiB), and memory as a table of
+// reference-counted CHIP8_PAGE_SIZE pages that are shared between
+// snapshots whenever they hold the same bytes.
+//
+// Every store to memory goes through chip8_invalidate(), which sets the
+// page's bit in chip8->dirty. A machine remembers the snapshot its memory
+// was last synced with (chip8->snap, the last one taken or restored), so
+//
+//  - snapshot_take() only copies the pages dirtied since then and shares
+//    the rest with that snapshot, and
+//  - snapshot_restore() only copies in the pages that are dirty or that
+//    differ between that snapshot and the one being restored, which for
+//    rewinding a few frames is usually a handful.
+//
+// Restored pages are passed to chip8_invalidate(), so that nothing stale is
+// left in the JIT.
+//
+// Reference counts aren't atomic: snapshots of one machine must not be
+// used from more than one thread at a time.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "snapshot.h"
+#include "util.h"
+
+static inline bool
+snapshot_dirty(struct CHIP8 *chip8, size_t pg)
+{
+	return (chip8->dirty[pg / 64] >> (pg % 64)) & 1;
+}
+
+static void
+snapshot_page_free(struct CHIP8_snapshot_page *page)
+{
+	if (--page->refs == 0)
+		free(page);
+}
+
+// Make `snap` the snapshot chip8's memory is in sync with.
+static void
+snapshot_attach(struct CHIP8 *chip8, struct CHIP8_snapshot *snap)
+{
+	snap->refs += 1;
+	snapshot_detach(chip8);
+	chip8->snap = snap;
+	memset(chip8->dirty, 0, sizeof(chip8->dirty));
+}
+
+struct CHIP8_snapshot *
+snapshot_take(struct CHIP8 *chip8)
+{
+	struct CHIP8_snapshot *base = chip8->snap;
+	struct CHIP8_snapshot *snap = ecalloc(1, sizeof(struct CHIP8_snapshot));
+	snap->refs = 1;
+	memcpy(snap->state, chip8, sizeof(snap->state));
+
+	for (size_t pg = 0; pg < CHIP8_PAGES; ++pg) {
+		uint8_t *data = &chip8->memory[pg << CHIP8_PAGE_SHIFT];
+		struct CHIP8_snapshot_page *page = base != NULL ? base->pages[pg] : NULL;
+
+		// A dirty page can still have been written with what was there.
+		if (page == NULL || (snapshot_dirty(chip8, pg)
+				&& memcmp(page->data, data, CHIP8_PAGE_SIZE) != 0)) {
+			page = ecalloc(1, sizeof(struct CHIP8_snapshot_page));
+			memcpy(page->data, data, CHIP8_PAGE_SIZE);
+		}
+
+		page->refs += 1;
+		snap->pages[pg] = page;
+	}
+
+	snapshot_attach(chip8, snap);
+	return snap;
+}
+
+void
+snapshot_restore(struct CHIP8 *chip8, struct CHIP8_snapshot *snap)
+{
+	struct CHIP8_snapshot *base = chip8->snap;
+
+	for (size_t pg = 0; pg < CHIP8_PAGES; ++pg) {
+		if (base != NULL && base->pages[pg] == snap->pages[pg] && !snapshot_dirty(chip8, pg))
+			continue;
+
+		memcpy(&chip8->memory[pg << CHIP8_PAGE_SHIFT], snap->pages[pg]->data, CHIP8_PAGE_SIZE);
+		chip8_invalidate(chip8, pg << CHIP8_PAGE_SHIFT, CHIP8_PAGE_SIZE);
+	}
+
+	// The keys held and the JIT's state belong to this machine, not
+	// the one the snapshot was taken from.
+	uint16_t keypad = chip8->keypad;
+	enum CHIP8_engine engine = chip8->engine;
+	struct CHIP8_jit *jit = chip8->jit;
+
+	memcpy(chip8, snap->state, sizeof(snap->state));
+
+	chip8->keypad = keypad;
+	chip8->engine = engine;
+	chip8->jit = jit;
+	chip8->dirty_rows = UINT64_MAX;
+
+	snapshot_attach(chip8, snap);
+}
+
+void
+snapshot_free(struct CHIP8_snapshot *snap)
+{
+	if (--snap->refs > 0)
+		return;
+
+	for (size_t pg = 0; pg < CHIP8_PAGES; ++pg)
+		snapshot_page_free(snap->pages[pg]);
+	free(snap);
+}
+
+// Drop chip8's reference to the last snapshot it was synced with. Must be
+// called before freeing a machine that has taken or restored snapshots.
+void
+snapshot_detach(struct CHIP8 *chip8)
+{
+	if (chip8->snap == NULL)
+		return;
+
+	snapshot_free(chip8->snap);
+	chip8->snap = NULL;
+}
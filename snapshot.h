@@ -0,0 +1,25 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+struct CHIP8_snapshot_page {
+	size_t  refs;
+	uint8_t data[CHIP8_PAGE_SIZE];
+};
+
+struct CHIP8_snapshot {
+	size_t  refs;
+	uint8_t state[offsetof(struct CHIP8, snap)];
+	struct CHIP8_snapshot_page *pages[CHIP8_PAGES];
+};
+
+struct CHIP8_snapshot *snapshot_take(struct CHIP8 *chip8);
+void snapshot_restore(struct CHIP8 *chip8, struct CHIP8_snapshot *snap);
+void snapshot_free(struct CHIP8_snapshot *snap);
+void snapshot_detach(struct CHIP8 *chip8);
+
+#endif
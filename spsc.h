@@ -0,0 +1,178 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+// Lock-free structures for handing data from one thread to exactly one
+// other: a bounded queue of fixed-size items, and a triple buffer for
+// always getting at the latest of a stream of large values.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+// A ring of `mask + 1` items of `size` bytes each. head and tail count
+// items pushed and popped since spsc_init() and are only ever increased,
+// each by one side; keeping them on separate cache lines keeps the two
+// sides from bouncing a line between them on every item.
+struct spsc {
+	_Alignas(64) atomic_size_t head; // written by the producer
+	_Alignas(64) atomic_size_t tail; // written by the consumer
+	_Alignas(64) size_t size;
+	size_t   mask;
+	uint8_t *items;
+};
+
+// `capacity` must be a power of two.
+static inline void
+spsc_init(struct spsc *q, size_t size, size_t capacity)
+{
+	ENSURE(capacity != 0 && (capacity & (capacity - 1)) == 0);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	q->size = size;
+	q->mask = capacity - 1;
+	q->items = ecalloc(capacity, size);
+}
+
+static inline void
+spsc_free(struct spsc *q)
+{
+	free(q->items);
+	q->items = NULL;
+}
+
+// Returns false, dropping the item, if the queue is full.
+static inline bool
+spsc_push(struct spsc *q, const void *item)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head - tail > q->mask)
+		return false;
+
+	memcpy(&q->items[(head & q->mask) * q->size], item, q->size);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return true;
+}
+
+// Returns false if the queue is empty.
+static inline bool
+spsc_pop(struct spsc *q, void *item)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (tail == head)
+		return false;
+
+	memcpy(item, &q->items[(tail & q->mask) * q->size], q->size);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+// Items in the queue. Exact on either side about its own end; the other
+// side may have moved on since.
+static inline size_t
+spsc_count(struct spsc *q)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	return head - tail;
+}
+
+// Copy `items` of `n` items between a run of the ring starting at
+// position `pos`, in at most two pieces, and back if `out`.
+static inline void
+spsc_copy(struct spsc *q, size_t pos, void *items, size_t n, bool out)
+{
+	size_t start = pos & q->mask;
+	size_t first = q->mask + 1 - start;
+	if (first > n) first = n;
+
+	uint8_t *ring = &q->items[start * q->size];
+	uint8_t *buf = items;
+	if (out) {
+		memcpy(buf, ring, first * q->size);
+		memcpy(buf + first * q->size, q->items, (n - first) * q->size);
+	} else {
+		memcpy(ring, buf, first * q->size);
+		memcpy(q->items, buf + first * q->size, (n - first) * q->size);
+	}
+}
+
+// Push as many of `n` items as there's room for, and return how many.
+static inline size_t
+spsc_write(struct spsc *q, const void *items, size_t n)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	size_t room = q->mask + 1 - (head - tail);
+	if (n > room) n = room;
+
+	spsc_copy(q, head, (void *)items, n, false);
+	atomic_store_explicit(&q->head, head + n, memory_order_release);
+	return n;
+}
+
+// Pop up to `n` items, and return how many there were.
+static inline size_t
+spsc_read(struct spsc *q, void *items, size_t n)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (n > head - tail) n = head - tail;
+
+	spsc_copy(q, tail, items, n, true);
+	atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+	return n;
+}
+
+// The bookkeeping of a triple buffer over three slots the caller
+// allocates. The producer fills slot `back` and publishes it; the consumer
+// reads slot `front`. Neither ever waits for the other: the slot in the
+// middle is swapped with one or the other atomically, and a value the
+// producer publishes over before the consumer got to it is just skipped.
+#define SPSC_FRESH 4 // set in `middle` until the consumer takes it
+
+struct spsc_triple {
+	_Alignas(64) atomic_uint middle;
+	_Alignas(64) unsigned back;  // the producer's
+	_Alignas(64) unsigned front; // the consumer's
+};
+
+static inline void
+spsc_triple_init(struct spsc_triple *t)
+{
+	t->back = 0;
+	atomic_init(&t->middle, 1);
+	t->front = 2;
+}
+
+// Publish the back slot and move on to another one. Returns true if the
+// slot published before it was never taken by the consumer, in which case
+// that slot is the new back slot.
+static inline bool
+spsc_triple_publish(struct spsc_triple *t)
+{
+	unsigned old = atomic_exchange_explicit(&t->middle, t->back | SPSC_FRESH, memory_order_acq_rel);
+	t->back = old & ~SPSC_FRESH;
+	return (old & SPSC_FRESH) != 0;
+}
+
+// Make the latest published slot the front slot. Returns false, leaving
+// the front slot as it was, if nothing was published since the last call.
+static inline bool
+spsc_triple_acquire(struct spsc_triple *t)
+{
+	if ((atomic_load_explicit(&t->middle, memory_order_relaxed) & SPSC_FRESH) == 0)
+		return false;
+
+	unsigned old = atomic_exchange_explicit(&t->middle, t->front, memory_order_acq_rel);
+	t->front = old & ~SPSC_FRESH;
+	return true;
+}
+
+#endif
@@ -1,16 +1,22 @@
 // Thanks:
 //    - https://tobiasvl.github.io/blog/write-a-chip-8-emulator/
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <time.h>
+#include <sys/timerfd.h>
 
 #include "chip8.h"
+#include "sched.h"
 #include "termbox.h"
 #include "util.h"
 
@@ -30,10 +36,36 @@ static size_t tb_status = 0;
 
 static size_t ui_height, ui_width;
 static bool ui_buzzer = false;
+static bool ui_stale = false; // redraw everything, the terminal was resized
+
+// How display pixels map to terminal cells: two rows of one pixel per
+// cell (▄ with different colours above and below), 2x2 quadrant blocks,
+// or 2x4 braille dots. The last two need a quarter and an eighth as many
+// cells, and so far fewer bytes per frame.
+enum renderer { R_HALF, R_QUAD, R_BRAILLE };
+static enum renderer renderer = R_HALF;
+static const struct { const char *name; size_t w, h; } cells[] = {
+	[R_HALF]    = { "half",    1, 2 },
+	[R_QUAD]    = { "quad",    2, 2 },
+	[R_BRAILLE] = { "braille", 2, 4 },
+};
+
+// Frames aren't drawn while more than this much of what was written to
+// the terminal is still waiting to be sent, over a slow ssh link say. The
+// rows they changed are drawn with the first frame after.
+#define OUTQ_MAX 4096
 
 static _Bool quit = false;
 static _Bool dbg = true;
 static size_t dbg_step = 0;
+static struct sched sched;
+static uint64_t frames = 0;
+
+// The terminal only tells us about keys being pressed, so a key counts as
+// held for KEY_HOLD frames after each press, by which time the terminal's
+// autorepeat should have pressed it again if it still is.
+#define KEY_HOLD 30
+static uint64_t key_until[16] = {0};
 
 struct CHIP8 chip8;
 
@@ -79,9 +111,92 @@ _draw_u08(uint8_t byte, size_t x, size_t y)
 	tb_change_cell(x + 1, y, d2 >= 10 ? (d2 - 10) + 'A' : d2 + '0', BLACK, WHITE);
 }
 
+// Find the pattern of the w x h pixels from (x, y), row by row from the top
+// left, bit 0 first.
+static size_t
+cell_pixels(size_t x, size_t y, size_t w, size_t h)
+{
+	size_t bits = 0;
+	for (size_t dy = 0; dy < h; ++dy)
+		for (size_t dx = 0; dx < w; ++dx)
+			if (chip8_pixel(&chip8, x + dx, y + dy))
+				bits |= 1 << (dy * w + dx);
+	return bits;
+}
+
+// Draw the display rows that changed, from cell row ty, and return the
+// cell row after the display.
+static size_t
+draw_display(size_t ty)
+{
+	// Quadrant blocks for every pattern of a 2x2 cell.
+	static const uint32_t quadrants[16] = {
+		' ',    0x2598, 0x259D, 0x2580, 0x2596, 0x258C, 0x259E, 0x259B,
+		0x2597, 0x259A, 0x2590, 0x259C, 0x2584, 0x2599, 0x259F, 0x2588,
+	};
+
+	// Braille dots for every pixel of a 2x4 cell, in cell_pixels() order.
+	static const uint8_t braille[8] = {
+		0x01, 0x08, 0x02, 0x10, 0x04, 0x20, 0x40, 0x80,
+	};
+
+	size_t height = chip8.hires ? S_D_HEIGHT : C_D_HEIGHT;
+	size_t width  = chip8.hires ? S_D_WIDTH  : C_D_WIDTH;
+	size_t cw = cells[renderer].w;
+	size_t ch = cells[renderer].h;
+
+	// termbox keeps the cell rows that haven't changed from last time.
+	for (size_t y = 0; y < height; y += ch, ++ty) {
+		if (((chip8.dirty_rows >> y) & ((1 << ch) - 1)) == 0) continue;
+
+		for (size_t x = 0; x < width; x += cw) {
+			size_t bits = cell_pixels(x, y, cw, ch);
+
+			switch (renderer) {
+			break; case R_HALF:
+				tb_change_cell(x, ty, 0x2584,
+					bits & 2 ? WHITE : BLACK,
+					bits & 1 ? WHITE : BLACK);
+			break; case R_QUAD:
+				tb_change_cell(x / cw, ty, quadrants[bits], WHITE, BLACK);
+			break; case R_BRAILLE: {
+				uint32_t dots = 0;
+				for (size_t i = 0; i < SIZEOF(braille); ++i)
+					if (bits & (1 << i)) dots |= braille[i];
+				tb_change_cell(x / cw, ty, 0x2800 + dots, WHITE, BLACK);
+			} break;
+			}
+		}
+	}
+	chip8.dirty_rows = 0;
+
+	return ty;
+}
+
+// What the register panel was last drawn with, so that it's only walked
+// again when something on it changed.
+struct panel {
+	uint8_t  vregs[16];
+	uint16_t I, SC, PC;
+	bool     dbg;
+	size_t   ty, height;
+};
+
 static void
 draw(void)
 {
+	static struct panel shown;
+	static bool shown_hires;
+
+	// Everything moves when the display changes size.
+	if (chip8.hires != shown_hires || ui_stale) {
+		shown_hires = chip8.hires;
+		ui_stale = false;
+		tb_clear();
+		chip8.dirty_rows = UINT64_MAX;
+		memset(&shown, 0xFF, sizeof(shown));
+	}
+
 	size_t ty = 0;
 	if (ui_buzzer) {
 		for (size_t x = 0; x < ui_width; ++x) tb_change_cell(x, ty, ' ', BLACK, L_RED);
@@ -90,15 +205,25 @@ draw(void)
 	}
 	ty += 2;
 
-	for (size_t y = 0; y < D_HEIGHT; y += 2, ++ty) {
-		for (size_t x = 0; x < D_WIDTH; ++x) {
-			uint32_t bg = chip8.display[D_WIDTH * (y+0) + x] ? WHITE : BLACK;
-			uint32_t fg = chip8.display[D_WIDTH * (y+1) + x] ? WHITE : BLACK;
-			tb_change_cell(x, ty, 0x2584, fg, bg);
-		}
-	}
+	ty = draw_display(ty);
 	ty += 2;
 
+	struct panel now;
+	memset(&now, 0, sizeof(now));
+	memcpy(now.vregs, chip8.vregs, sizeof(now.vregs));
+	now.I = chip8.I;
+	now.SC = chip8.SC;
+	now.PC = chip8.PC;
+	now.dbg = dbg;
+	now.ty = ty;
+	now.height = ui_height;
+
+	if (memcmp(&now, &shown, sizeof(now)) == 0) {
+		tb_present();
+		return;
+	}
+	shown = now;
+
 	for (
 		ssize_t ity = ty, i = chip8.PC - 6;
 		i < (ssize_t)sizeof(chip8.memory) && ity < (ssize_t)ui_height;
@@ -162,11 +287,9 @@ draw(void)
 	tb_present();
 }
 
-static size_t
-keydown(char key)
+static void
+press(uint32_t ch)
 {
-	draw();
-
 	const char keys[] = {
 		'X', '1', '2', '3',
 		'Q', 'W', 'E', 'A',
@@ -174,37 +297,70 @@ keydown(char key)
 		'4', 'R', 'F', 'V'
 	};
 
-	struct tb_event ev;
-	ssize_t ret = 0;
-
-	if ((ret = tb_peek_event(&ev, 512)) == 0)
-		return 0;
-        ENSURE(ret != -1); /* termbox error */
-
-	if (ev.type == TB_EVENT_KEY && ev.ch) {
-		return keys[(size_t)key] == (char)MAX(ev.ch, 255);
-	} else if (ev.type == TB_EVENT_KEY && ev.key) {
-		switch (ev.key) {
-		break; case TB_KEY_CTRL_C: quit = true;
-		break; case TB_KEY_CTRL_D: dbg = !dbg;
-		break; case TB_KEY_CTRL_E: dbg_step += 1;
+	for (size_t key = 0; key < SIZEOF(keys); ++key) {
+		if (ch > 127 || keys[key] != toupper((int)ch))
+			continue;
+
+		chip8_key(&chip8, key, true);
+		key_until[key] = frames + KEY_HOLD;
+
+		// An FX0A waits for a key to be let go of, which here would
+		// take KEY_HOLD frames; a tap is all a terminal can tell apart
+		// from holding the key anyway.
+		if (chip8.wait_key != -1) {
+			chip8_key(&chip8, key, false);
+			chip8_key(&chip8, key, true);
 		}
-	} else if (ev.type == TB_EVENT_RESIZE) {
-		ui_height = tb_height();
-		ui_width = tb_width();
 	}
+}
 
-	return 0;
+// Let go of the keys that haven't been pressed again for KEY_HOLD frames.
+static void
+release(void)
+{
+	for (size_t key = 0; key < SIZEOF(key_until); ++key)
+		if (((chip8.keypad >> key) & 1) && key_until[key] <= frames)
+			chip8_key(&chip8, key, false);
+}
+
+// Handle every event termbox has, without waiting for more.
+static void
+events(void)
+{
+	struct tb_event ev;
+	ssize_t ret;
+
+	while ((ret = tb_peek_event(&ev, 0)) > 0) {
+		if (ev.type == TB_EVENT_KEY && ev.ch) {
+			press(ev.ch);
+		} else if (ev.type == TB_EVENT_KEY && ev.key) {
+			switch (ev.key) {
+			break; case TB_KEY_CTRL_C: quit = true;
+			break; case TB_KEY_CTRL_D: dbg = !dbg;
+			break; case TB_KEY_CTRL_E: dbg_step += 1;
+			}
+		} else if (ev.type == TB_EVENT_RESIZE) {
+			ui_height = tb_height();
+			ui_width = tb_width();
+			ui_stale = true;
+		}
+	}
+	ENSURE(ret != -1); /* termbox error */
 }
 
 static void
 load(char *filename)
 {
 	struct stat st;
-	stat(filename, &st); // TODO: assert that retcode != 0
+	if (stat(filename, &st) != 0)
+		die("Could not stat %%s:", filename);
+	if ((size_t)st.st_size > sizeof(((struct CHIP8 *)0)->memory) - ROM_START)
+		die("%%s is too large (%%zu bytes)", filename, (size_t)st.st_size);
 
 	char *src = ecalloc(st.st_size, sizeof(char));
 	FILE *src_f = fopen(filename, "rb");
+	if (src_f == NULL)
+		die("Could not open %%s:", filename);
 	fread(src, sizeof(char), st.st_size, src_f);
 	fclose(src_f);
 
@@ -213,69 +369,100 @@ load(char *filename)
 	free(src);
 }
 
+// Arm the timerfd for when the next frame is due, or disarm it.
+static void
+arm(int timer, bool on)
+{
+	uint64_t due = on ? sched_next(&sched) : 0;
+	struct itimerspec its = {
+		.it_value = { due / 1000000000, due % 1000000000 },
+	};
+
+	// A zero time disarms it, so a frame due at exactly 0 would never
+	// come; CLOCK_MONOTONIC starts at boot, so it never is.
+	if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+		die("Could not arm the frame timer:");
+}
+
+// Sleep in poll() until there's a key to handle or a frame due. Frames come
+// from a timerfd armed for when `sched` says the next one is due, so the
+// loop costs nothing while waiting, and a frame late because of a slow
+// draw() makes the next come sooner. The debugger disarms it altogether.
 static void
 exec(void)
 {
-	ssize_t rs = 1000 / 60;
+	int tty = open("/dev/tty", O_RDONLY | O_CLOEXEC);
+	if (tty == -1)
+		die("Could not open /dev/tty:");
 
-	struct timespec t;
-	clock_gettime(CLOCK_BOOTTIME, &t);
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer == -1)
+		die("Could not create the frame timer:");
 
-	ssize_t last_ticks = t.tv_nsec / 1000000;
-	ssize_t last_delta = 0;
-	ssize_t global_delta = 0;
-	ssize_t step_delta = 0;
-	ssize_t render_delta = 0;
+	bool running = !dbg;
+	arm(timer, running);
+
+	struct pollfd fds[] = {
+		{ .fd = tty,   .events = POLLIN },
+		{ .fd = timer, .events = POLLIN },
+	};
 
 	while (!quit) {
-		if (chip8.wait_key == -1) keydown(0);
+		// termbox may already have read more events than the one it
+		// handed out, which poll() can't know about.
+		events();
 
-		if (dbg) {
-			if (dbg_step > 0) {
-				draw();
+		if (dbg && dbg_step > 0) {
+			for (; dbg_step > 0; --dbg_step) {
 				chip8_step(&chip8);
-				chip8.delay_tmr = CHKSUB(chip8.delay_tmr, 1);
-				chip8.sound_tmr = CHKSUB(chip8.sound_tmr, 1);
-				ui_buzzer = chip8.sound_tmr > 0;
-				chip8.redraw = false;
-				--dbg_step;
+				chip8_tick(&chip8);
 			}
-
-			usleep(10000);
-			continue;
+			ui_buzzer = chip8.sound_tmr > 0;
+			draw();
 		}
 
-		// Update timers.
-		clock_gettime(CLOCK_BOOTTIME, &t);
-		ssize_t new_last_ticks = t.tv_nsec / 1000000;
-		last_delta = new_last_ticks - last_ticks;
-		last_ticks = new_last_ticks;
-
-		step_delta += last_delta;
-		for (; step_delta >= 1; --step_delta)
-			chip8_step(&chip8);
-
-		global_delta += last_delta;
-		while (global_delta > rs) {
-			global_delta -= rs;
-
-			chip8.delay_tmr = CHKSUB(chip8.delay_tmr, 1);
-			chip8.sound_tmr = CHKSUB(chip8.sound_tmr, 1);
-
-			ui_buzzer = chip8.sound_tmr > 0;
+		// Start pacing over when leaving the debugger, rather than
+		// catching up on the time spent in it.
+		if (running != !dbg) {
+			running = !dbg;
+			if (running) sched_reset(&sched);
+			arm(timer, running);
+			draw();
 		}
 
-		render_delta += last_delta;
-		if (render_delta > rs) {
-			if (chip8.redraw) {
-				draw();
-				chip8.redraw = false;
-			}
-			render_delta -= rs;
+		if (poll(fds, SIZEOF(fds), -1) == -1) {
+			if (errno == EINTR) continue; // SIGWINCH, for termbox
+			die("poll:");
 		}
 
-		usleep(1000);
+		// The terminal is gone; poll() would never block again.
+		if (fds[0].revents & (POLLHUP | POLLERR))
+			break;
+
+		uint64_t expirations;
+		if (!running || read(timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+			continue;
+
+		release();
+		size_t ran = chip8_run(&chip8, sched_budget(&sched));
+		chip8_tick(&chip8);
+		ui_buzzer = chip8.sound_tmr > 0;
+		frames += 1;
+
+		int outq = 0;
+		if (ioctl(tty, TIOCOUTQ, &outq) != 0)
+			outq = 0;
+		if (chip8.dirty_rows != 0 && outq <= OUTQ_MAX)
+			draw();
+
+		// Skipped frames are reported once termbox is done with the
+		// terminal.
+		sched_end(&sched, ran);
+		arm(timer, true);
 	}
+
+	close(timer);
+	close(tty);
 }
 
 static void
@@ -291,14 +478,51 @@ int
 main(int argc, char **argv)
 {
 	char *filename = "ibm.ch8";
-	if (argc > 1) filename = argv[1];
+	size_t cycles = 1500;
+	bool max_speed = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:md:")) != -1) {
+		switch (opt) {
+		break; case 'c':
+			cycles = strtoull(optarg, NULL, 0);
+		break; case 'm':
+			max_speed = true;
+		break; case 'd': {
+			size_t r = 0;
+			while (r < SIZEOF(cells) && strcmp(optarg, cells[r].name) != 0)
+				++r;
+			if (r == SIZEOF(cells))
+				die("-d takes half, quad or braille");
+			renderer = r;
+		} break; default:
+			fprintf(stderr, "usage: %s [-c cycles] [-m] [-d half|quad|braille] [rom]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) filename = argv[optind];
+	if (cycles == 0)
+		die("-c needs at least one instruction per frame");
 
 	init_gui();
-	chip8_init(&chip8, keydown);
+	chip8_init(&chip8);
 	load(filename);
+#ifdef CHIP8_PROFILER
+	chip8_profile_start(&chip8);
+#endif
 	draw();
+	sched_init(&sched, 60, cycles, max_speed);
 	exec();
 	fini();
+#ifdef CHIP8_PROFILER
+	chip8_profile_dump(&chip8, CHIP8_PROFILE_FILE);
+	chip8_profile_fold(&chip8, CHIP8_FOLDED_FILE);
+	chip8_profile_stop(&chip8);
+#endif
+
+	if (sched.late != 0)
+		log("%llu frames ran late, %llu of them were skipped",
+			(unsigned long long)sched.late, (unsigned long long)sched.dropped);
 
 	return 0;
 }
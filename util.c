@@ -17,6 +17,19 @@ ecalloc(size_t nmemb, size_t size)
 	return m;
 }
 
+// Zeroed allocation of nmemb objects whose type requires `align` (a power
+// of two, and a divisor of size) alignment, such as struct CHIP8. Free with
+// free(3).
+void *
+ecalloc_aligned(size_t align, size_t nmemb, size_t size)
+{
+	void *m;
+	if (!(m = aligned_alloc(align, nmemb * size)))
+		die("Could not allocate %zu bytes:", nmemb * size);
+	memset(m, 0, nmemb * size);
+	return m;
+}
+
 void
 __ensure(_Bool expr, char *str, char *file, size_t line, const char *fn)
 {
@@ -81,6 +94,17 @@ format(const char *fmt, ...)
 	return (char *) &buf;
 }
 
+uint64_t
+fnv1a(const void *data, size_t len, uint64_t hash)
+{
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
 static float
 _hue_to_rgb(float p, float q, float t)
 {
@@ -15,6 +15,7 @@
 #define log(fmt, ...) fprintf(stderr, "LOG: "fmt"\n", __VA_ARGS__)
 
 void *ecalloc(size_t nmemb, size_t size);
+void *ecalloc_aligned(size_t align, size_t nmemb, size_t size);
 
 /* a reimplementation of assert(3) that calls die() instead of abort(3) */
 #define ENSURE(EXPR) (__ensure((EXPR), #EXPR, __FILE__, __LINE__, __func__))
@@ -24,4 +25,7 @@ void die(const char *fmt, ...);
 char *format(const char *format, ...);
 uint32_t hsl_to_rgb(float _h, float _s, float _l);
 
+#define FNV1A_INIT 0xcbf29ce484222325
+uint64_t fnv1a(const void *data, size_t len, uint64_t hash);
+
 #endif